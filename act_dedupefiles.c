@@ -15,6 +15,7 @@
 
 #include "act_dedupefiles.h"
 #include "libjodycode.h"
+#include "probes.h"
 
 #ifdef __linux__
  /* Use built-in static dedupe header if requested */
@@ -22,6 +23,7 @@
   #include "linux-dedupe-static.h"
  #else
   #include <linux/fs.h>
+  #include <linux/fiemap.h>
  #endif /* STATIC_DEDUPE_H */
 
  /* If the Linux headers are too old, automatically use the static one */
@@ -30,8 +32,30 @@
   #include "linux-dedupe-static.h"
  #endif /* FILE_DEDUPE_RANGE_SAME */
  #include <sys/ioctl.h>
+ #include <sys/resource.h>
+ #ifndef NO_THREADS
+  #include <pthread.h>
+ #endif
  #define JDUPES_DEDUPE_SUPPORTED 1
  #define KERNEL_DEDUP_MAX_SIZE 16777216
+ /* The kernel rejects FIDEDUPERANGE requests larger than one page */
+ #define KERNEL_DEDUP_MAX_DESTS ((4096 - sizeof(struct file_dedupe_range)) / sizeof(struct file_dedupe_range_info))
+ /* File descriptors to leave free for everything else */
+ #define DEDUPE_FD_RESERVE 16
+ /* Partial-file dedupe (-G) compares and dedupes aligned blocks of this size */
+ #ifndef DEDUPE_BLOCK_SIZE
+  #define DEDUPE_BLOCK_SIZE 131072
+ #endif
+ /* Smaller files are not worth comparing block by block */
+ #ifndef DEDUPE_BLOCK_MIN_SIZE
+  #define DEDUPE_BLOCK_MIN_SIZE (DEDUPE_BLOCK_SIZE * 4)
+ #endif
+ /* Extents requested per FIEMAP call */
+ #define DEDUPE_FIEMAP_EXTENTS 128
+ /* Extents that can't be compared by physical address */
+ #define DEDUPE_FIEMAP_UNUSABLE (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | \
+	 FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_DATA_ENCRYPTED | FIEMAP_EXTENT_NOT_ALIGNED | \
+	 FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL | FIEMAP_EXTENT_UNWRITTEN)
  /* Error messages */
  static const char s_err_dedupe_notabug[] = "This is not a bug in jdupes; check your file stats/permissions.";
  static const char s_err_dedupe_repeated[] = "This verbose error description will not be repeated.";
@@ -49,117 +73,770 @@
 #error Dedupe is only supported on Linux and macOS
 #endif
 
-void dedupefiles(file_t * restrict files)
-{
 #ifdef __linux__
+/* Physical extent map of a file, sorted by logical offset */
+struct dedupe_extmap {
+  struct fiemap_extent *ext;
+  uint32_t count;
+};
+
+/* One destination in a batch; results are reported in list order */
+struct dedupe_dest {
+  file_t *file;
+  struct dedupe_extmap *map;  /* NULL if the extents are unknown */
+  int fd;       /* -1 for hard links to the source, which are not deduped */
+  int status;   /* FILE_DEDUPE_RANGE_SAME/_DIFFERS or a negative errno */
+  int err;      /* errno if the ioctl() call itself failed */
+};
+
+/* Per-worker request buffers */
+struct dedupe_ctx {
   struct file_dedupe_range *fdr;
-  struct file_dedupe_range_info *fdri;
-  file_t *curfile, *curfile2, *dupefile;
-  int src_fd;
-  int err_twentytwo = 0, err_ninetyfive = 0;
-  uint64_t total_files = 0;
+  struct dedupe_dest *dests;
+  struct dedupe_extmap *src_map;
+  int *active;
+  int *pick;
+  int max_dests;
+};
 
-  LOUD(fprintf(stderr, "\ndedupefiles: %p\n", files);)
+/* Errors that get a verbose description the first time they are seen */
+#define DEDUPE_ERR_EINVAL	(1U << 0)
+#define DEDUPE_ERR_EOPNOTSUPP	(1U << 1)
 
-  fdr = (struct file_dedupe_range *)calloc(1,
-        sizeof(struct file_dedupe_range)
-      + sizeof(struct file_dedupe_range_info) + 1);
-  fdr->dest_count = 1;
-  fdri = &fdr->info[0];
-  for (curfile = files; curfile; curfile = curfile->next) {
-    /* Skip all files that have no duplicates */
-    if (!ISFLAG(curfile->flags, FF_HAS_DUPES)) continue;
-    CLEARFLAG(curfile->flags, FF_HAS_DUPES);
+/* Result of deduplicating one set of duplicates */
+struct dedupe_result {
+  uint64_t files;
+  unsigned int errors;  /* DEDUPE_ERR_* */
+  int failed;
+};
 
-    /* For each duplicate list head, handle the duplicates in the list */
-    curfile2 = curfile;
-    src_fd = open(curfile->d_name, O_RDONLY);
-    /* If an open fails, keep going down the dupe list until it is exhausted */
-    while (src_fd == -1 && curfile2->duplicates && curfile2->duplicates->duplicates) {
-      fprintf(stderr, "dedupe: open failed (skipping): %s\n", curfile2->d_name);
-      exit_status = EXIT_FAILURE;
-      curfile2 = curfile2->duplicates;
-      src_fd = open(curfile2->d_name, O_RDONLY);
+
+/* Report a destination that couldn't be deduped; 'status' is
+ * FILE_DEDUPE_RANGE_DIFFERS or a negative errno, 'err' is the errno of a
+ * failed ioctl() call */
+static void dedupe_report_error(const char * const restrict name, const int status, const int err,
+    FILE *out, FILE *err_out, struct dedupe_result * const restrict res)
+{
+  fprintf(out, "  -XX-> %s\n", name);
+  fprintf(err_out, "error: ");
+  if (status == FILE_DEDUPE_RANGE_DIFFERS) {
+    fprintf(err_out, "not identical (files modified between scan and dedupe?)\n");
+    res->failed = 1;
+  } else if (status != 0) {
+    fprintf(err_out, "%s (%d)\n", strerror(-status), status);
+    res->failed = 1;
+  } else if (err != 0) {
+    fprintf(err_out, "%s (%d)\n", strerror(err), err);
+    res->failed = 1;
+  }
+  if (status == -22 || err == 22) res->errors |= DEDUPE_ERR_EINVAL;
+  if (status == -95 || err == 95) res->errors |= DEDUPE_ERR_EOPNOTSUPP;
+  return;
+}
+
+
+static void dedupe_report(const struct dedupe_dest * const restrict dest, FILE *out, FILE *err_out, struct dedupe_result * const restrict res)
+{
+  if (dest->fd == -1) {
+    fprintf(out, "  -==-> %s\n", dest->file->d_name);
+    return;
+  }
+  if (dest->status == FILE_DEDUPE_RANGE_SAME && dest->err == 0) {
+    /* Dedupe OK; report to the user and add to file count */
+    fprintf(out, "  ====> %s\n", dest->file->d_name);
+    res->files++;
+    return;
+  }
+  dedupe_report_error(dest->file->d_name, dest->status, dest->err, out, err_out, res);
+  return;
+}
+
+
+/* Print the verbose description of an error class the first time it shows up */
+static void dedupe_explain(const unsigned int errors, unsigned int * const restrict explained)
+{
+  if (ISFLAG(errors, DEDUPE_ERR_EINVAL) && !ISFLAG(*explained, DEDUPE_ERR_EINVAL)) {
+    fprintf(stderr, "       One or more files being deduped are read-only or hard linked.\n");
+    fprintf(stderr, "       Read-only files can only be deduped by the root user.\n");
+    fprintf(stderr, "       %s\n", s_err_dedupe_notabug);
+    fprintf(stderr, "       %s\n", s_err_dedupe_repeated);
+    SETFLAG(*explained, DEDUPE_ERR_EINVAL);
+  }
+  if (ISFLAG(errors, DEDUPE_ERR_EOPNOTSUPP) && !ISFLAG(*explained, DEDUPE_ERR_EOPNOTSUPP)) {
+    fprintf(stderr, "       One or more files is on a filesystem that does not support\n");
+    fprintf(stderr, "       block-level deduplication or are on different filesystems.\n");
+    fprintf(stderr, "       %s\n", s_err_dedupe_notabug);
+    fprintf(stderr, "       %s\n", s_err_dedupe_repeated);
+    SETFLAG(*explained, DEDUPE_ERR_EOPNOTSUPP);
+  }
+  return;
+}
+
+
+/* Read the physical extent map of an open file; returns NULL if the
+ * filesystem can't report one */
+static struct dedupe_extmap *get_extent_map(const int fd, const off_t size)
+{
+  struct fiemap *fm;
+  struct dedupe_extmap *map;
+  uint32_t alloc = DEDUPE_FIEMAP_EXTENTS;
+  uint64_t start = 0;
+  int last = 0;
+
+  fm = (struct fiemap *)malloc(sizeof(struct fiemap) + sizeof(struct fiemap_extent) * DEDUPE_FIEMAP_EXTENTS);
+  map = (struct dedupe_extmap *)malloc(sizeof(struct dedupe_extmap));
+  if (fm == NULL || map == NULL) jc_oom("get_extent_map()");
+  map->count = 0;
+  map->ext = (struct fiemap_extent *)malloc(sizeof(struct fiemap_extent) * alloc);
+  if (map->ext == NULL) jc_oom("get_extent_map()");
+
+  while (last == 0 && start < (uint64_t)size) {
+    memset(fm, 0, sizeof(struct fiemap));
+    fm->fm_start = start;
+    fm->fm_length = (uint64_t)size - start;
+    fm->fm_flags = FIEMAP_FLAG_SYNC;
+    fm->fm_extent_count = DEDUPE_FIEMAP_EXTENTS;
+    if (ioctl(fd, FS_IOC_FIEMAP, fm) != 0 || fm->fm_mapped_extents == 0) break;
+    if (map->count + fm->fm_mapped_extents > alloc) {
+      alloc *= 2;
+      map->ext = (struct fiemap_extent *)realloc(map->ext, sizeof(struct fiemap_extent) * alloc);
+      if (map->ext == NULL) jc_oom("get_extent_map()");
     }
-    if (src_fd == -1) continue;
-    printf("  [SRC] %s\n", curfile2->d_name);
+    memcpy(map->ext + map->count, fm->fm_extents, sizeof(struct fiemap_extent) * fm->fm_mapped_extents);
+    map->count += fm->fm_mapped_extents;
+    last = ISFLAG(fm->fm_extents[fm->fm_mapped_extents - 1].fe_flags, FIEMAP_EXTENT_LAST);
+    start = fm->fm_extents[fm->fm_mapped_extents - 1].fe_logical + fm->fm_extents[fm->fm_mapped_extents - 1].fe_length;
+  }
+  free(fm);
+  if (last == 0 && start < (uint64_t)size) {
+    free(map->ext);
+    free(map);
+    return NULL;
+  }
+  return map;
+}
+
+
+static void free_extent_map(struct dedupe_extmap *map)
+{
+  if (map == NULL) return;
+  free(map->ext);
+  free(map);
+  return;
+}
+
+
+/* Find the extent holding a logical offset, starting at extent *idx */
+static const struct fiemap_extent *find_extent(const struct dedupe_extmap * const restrict map,
+    const uint64_t off, uint32_t * const restrict idx)
+{
+  while (*idx < map->count && map->ext[*idx].fe_logical + map->ext[*idx].fe_length <= off) (*idx)++;
+  if (*idx >= map->count || map->ext[*idx].fe_logical > off) return NULL;
+  if (ISFLAG(map->ext[*idx].fe_flags, DEDUPE_FIEMAP_UNUSABLE)) return NULL;
+  return &map->ext[*idx];
+}
 
-    /* Run dedupe for each set */
-    for (dupefile = curfile->duplicates; dupefile; dupefile = dupefile->duplicates) {
-      off_t remain;
-      int err;
 
+/* Returns 1 if every byte in a range already points at the same physical
+ * blocks in both files, i.e. the range was deduplicated before */
+static int range_is_shared(const struct dedupe_extmap * const restrict src,
+    const struct dedupe_extmap * const restrict dst, uint64_t off, const uint64_t len)
+{
+  const uint64_t end = off + len;
+  uint32_t si = 0, di = 0;
+
+  if (src == NULL || dst == NULL) return 0;
+  while (off < end) {
+    const struct fiemap_extent *se = find_extent(src, off, &si);
+    const struct fiemap_extent *de = find_extent(dst, off, &di);
+    uint64_t next;
+
+    if (se == NULL || de == NULL) return 0;
+    if (se->fe_physical + (off - se->fe_logical) != de->fe_physical + (off - de->fe_logical)) return 0;
+    next = se->fe_logical + se->fe_length;
+    if (de->fe_logical + de->fe_length < next) next = de->fe_logical + de->fe_length;
+    off = next;
+  }
+  return 1;
+}
+
+
+/* Dedupe a batch of open destinations against the source in one pass
+ * Every destination goes into a single FIDEDUPERANGE request per window, so
+ * the kernel reads and locks each source range once instead of once per
+ * destination. Destinations that fail are dropped from later windows, and
+ * destinations whose extents in a window are already shared with the
+ * source are left out of that window's request. */
+static void dedupe_batch(const int src_fd, const off_t size, struct dedupe_ctx * const restrict ctx, const int cnt)
+{
+  struct file_dedupe_range * const fdr = ctx->fdr;
+  struct dedupe_dest * const dests = ctx->dests;
+  int * const active = ctx->active;
+  int * const pick = ctx->pick;
+  unsigned int nactive = 0;
+  off_t remain = size;
+
+  for (int i = 0; i < cnt; i++) {
+    dests[i].status = FILE_DEDUPE_RANGE_SAME;
+    dests[i].err = 0;
+    if (dests[i].fd != -1) active[nactive++] = i;
+  }
+
+  /* Consume data blocks until no data remains, 16 MiB or less at a time */
+  while (remain > 0 && nactive > 0) {
+    unsigned int j = 0, npick = 0;
+
+    fdr->src_offset = (uint64_t)(size - remain);
+    fdr->src_length = (uint64_t)(remain <= KERNEL_DEDUP_MAX_SIZE ? remain : KERNEL_DEDUP_MAX_SIZE);
+    remain -= (off_t)fdr->src_length;
+    for (unsigned int i = 0; i < nactive; i++) {
+      struct dedupe_dest * const dest = &dests[active[i]];
+
+      if (range_is_shared(ctx->src_map, dest->map, fdr->src_offset, fdr->src_length)) continue;
+      pick[npick] = active[i];
+      fdr->info[npick].dest_fd = dest->fd;
+      fdr->info[npick].dest_offset = fdr->src_offset;
+      fdr->info[npick].bytes_deduped = 0;
+      fdr->info[npick].status = FILE_DEDUPE_RANGE_SAME;
+      fdr->info[npick].reserved = 0;
+      npick++;
+    }
+    if (npick == 0) {
+      LOUD(fprintf(stderr, "dedupe_batch: skipping shared range at %" PRIu64 "\n", (uint64_t)fdr->src_offset);)
+      continue;
+    }
+    fdr->dest_count = (uint16_t)npick;
+    PROBE4(dedupe_start, src_fd, fdr->src_offset, fdr->src_length, npick);
+    errno = 0;
+    if (ioctl(src_fd, FIDEDUPERANGE, fdr) != 0) {
+      PROBE4(dedupe_done, src_fd, fdr->src_offset, fdr->src_length, -errno);
+      /* Later windows are never submitted, so destinations skipped in this
+       * one because they were already shared have failed too */
+      for (unsigned int i = 0; i < nactive; i++) dests[active[i]].err = errno;
+      break;
+    }
+    PROBE4(dedupe_done, src_fd, fdr->src_offset, fdr->src_length, 0);
+    for (unsigned int i = 0; i < npick; i++)
+      if (fdr->info[i].status != FILE_DEDUPE_RANGE_SAME) dests[pick[i]].status = fdr->info[i].status;
+    for (unsigned int i = 0; i < nactive; i++)
+      if (dests[active[i]].status == FILE_DEDUPE_RANGE_SAME) active[j++] = active[i];
+    nactive = j;
+  }
+  return;
+}
+
+
+/* Dedupe one set of duplicates, writing its report to 'out' and 'err_out' */
+static void dedupe_set(file_t *curfile, struct dedupe_ctx * const restrict ctx,
+    FILE *out, FILE *err_out, struct dedupe_result * const restrict res)
+{
+  file_t *curfile2, *dupefile;
+  int src_fd;
+
+  /* For each duplicate list head, handle the duplicates in the list */
+  curfile2 = curfile;
+  src_fd = open(curfile->d_name, O_RDONLY);
+  /* If an open fails, keep going down the dupe list until it is exhausted */
+  while (src_fd == -1 && curfile2->duplicates && curfile2->duplicates->duplicates) {
+    fprintf(err_out, "dedupe: open failed (skipping): %s\n", curfile2->d_name);
+    res->failed = 1;
+    curfile2 = curfile2->duplicates;
+    src_fd = open(curfile2->d_name, O_RDONLY);
+  }
+  if (src_fd == -1) return;
+  fprintf(out, "  [SRC] %s\n", curfile2->d_name);
+  ctx->src_map = get_extent_map(src_fd, curfile2->size);
+
+  /* Open destinations in batches and dedupe each batch together */
+  dupefile = curfile->duplicates;
+  while (dupefile) {
+    struct dedupe_dest * const dests = ctx->dests;
+    int cnt = 0;
+
+    for (; dupefile && cnt < ctx->max_dests; dupefile = dupefile->duplicates) {
       /* Don't pass hard links to dedupe */
-      if (dupefile->device == curfile->device && dupefile->inode == curfile->inode) {
-        printf("  -==-> %s\n", dupefile->d_name);
+      if (dupefile->device == curfile2->device && dupefile->inode == curfile2->inode) {
+        dests[cnt].file = dupefile;
+        dests[cnt].map = NULL;
+        dests[cnt].fd = -1;
+        cnt++;
         continue;
       }
-
       /* Open destination file, skipping any that fail */
-      fdri->dest_fd = open(dupefile->d_name, O_RDONLY);
-      if (fdri->dest_fd == -1) {
-        fprintf(stderr, "dedupe: open failed (skipping): %s\n", dupefile->d_name);
-        exit_status = EXIT_FAILURE;
+      dests[cnt].fd = open(dupefile->d_name, O_RDONLY);
+      if (dests[cnt].fd == -1) {
+        fprintf(err_out, "dedupe: open failed (skipping): %s\n", dupefile->d_name);
+        res->failed = 1;
         continue;
       }
+      dests[cnt].file = dupefile;
+      /* Only worth asking if the source extents are known */
+      dests[cnt].map = (ctx->src_map != NULL) ? get_extent_map(dests[cnt].fd, dupefile->size) : NULL;
+      cnt++;
+    }
+
+    dedupe_batch(src_fd, curfile2->size, ctx, cnt);
+    for (int i = 0; i < cnt; i++) {
+      dedupe_report(&dests[i], out, err_out, res);
+      if (dests[i].fd != -1) close(dests[i].fd);
+      free_extent_map(dests[i].map);
+    }
+  }
+  fprintf(out, "\n");
+  free_extent_map(ctx->src_map);
+  ctx->src_map = NULL;
+  close(src_fd);
+  res->files++;
+  return;
+}
+
+
+static void alloc_dedupe_ctx(struct dedupe_ctx * const restrict ctx, const int max_dests)
+{
+  ctx->max_dests = max_dests;
+  ctx->fdr = (struct file_dedupe_range *)calloc(1,
+        sizeof(struct file_dedupe_range)
+      + sizeof(struct file_dedupe_range_info) * (size_t)max_dests);
+  ctx->dests = (struct dedupe_dest *)calloc((size_t)max_dests, sizeof(struct dedupe_dest));
+  ctx->active = (int *)calloc((size_t)max_dests, sizeof(int));
+  ctx->pick = (int *)calloc((size_t)max_dests, sizeof(int));
+  ctx->src_map = NULL;
+  if (ctx->fdr == NULL || ctx->dests == NULL || ctx->active == NULL || ctx->pick == NULL) jc_oom("dedupefiles()");
+  return;
+}
+
+
+static void free_dedupe_ctx(struct dedupe_ctx * const restrict ctx)
+{
+  free(ctx->fdr);
+  free(ctx->dests);
+  free(ctx->active);
+  free(ctx->pick);
+  return;
+}
+
+
+#ifndef NO_THREADS
+/* Sets are handed out to workers in list order; each worker buffers the
+ * report for its set and the main thread prints the buffers in list order,
+ * so the output is the same as a single-threaded run */
+struct dedupe_job {
+  file_t *head;
+  char *out, *err;
+  size_t outlen, errlen;
+  struct dedupe_result res;
+  int done;
+};
+
+struct dedupe_pool {
+  struct dedupe_job *jobs;
+  size_t cnt;
+  size_t next;
+  int max_dests;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+
+static void *dedupe_worker(void *arg)
+{
+  struct dedupe_pool * const pool = (struct dedupe_pool *)arg;
+  struct dedupe_ctx ctx;
+
+  alloc_dedupe_ctx(&ctx, pool->max_dests);
+  while (1) {
+    struct dedupe_job *job;
+    FILE *out, *err_out;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->next >= pool->cnt) {
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
+    job = &pool->jobs[pool->next++];
+    pthread_mutex_unlock(&pool->lock);
+
+    out = open_memstream(&job->out, &job->outlen);
+    err_out = open_memstream(&job->err, &job->errlen);
+    if (out == NULL || err_out == NULL) jc_oom("dedupe_worker()");
+    dedupe_set(job->head, &ctx, out, err_out, &job->res);
+    fclose(out);
+    fclose(err_out);
+
+    pthread_mutex_lock(&pool->lock);
+    job->done = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+  }
+  free_dedupe_ctx(&ctx);
+  return NULL;
+}
+
+
+/* Returns -1 if the pool could not be started so the caller can go serial */
+static int dedupe_parallel(file_t *files, unsigned int workers, const int max_dests,
+    uint64_t * const restrict total_files, unsigned int * const restrict explained)
+{
+  struct dedupe_pool pool;
+  pthread_t *threads;
+  unsigned int started = 0;
+  size_t i, alloc = 64;
+  file_t *curfile;
+
+  memset(&pool, 0, sizeof(struct dedupe_pool));
+  pool.jobs = (struct dedupe_job *)malloc(sizeof(struct dedupe_job) * alloc);
+  if (pool.jobs == NULL) jc_oom("dedupe_parallel()");
+  for (curfile = files; curfile; curfile = curfile->next) {
+    if (!ISFLAG(curfile->flags, FF_HAS_DUPES)) continue;
+    if (pool.cnt == alloc) {
+      alloc *= 2;
+      pool.jobs = (struct dedupe_job *)realloc(pool.jobs, sizeof(struct dedupe_job) * alloc);
+      if (pool.jobs == NULL) jc_oom("dedupe_parallel()");
+    }
+    memset(&pool.jobs[pool.cnt], 0, sizeof(struct dedupe_job));
+    pool.jobs[pool.cnt].head = curfile;
+    pool.cnt++;
+  }
+  if (pool.cnt == 0) {
+    free(pool.jobs);
+    return 0;
+  }
+  if (workers > pool.cnt) workers = (unsigned int)pool.cnt;
+  pool.max_dests = max_dests;
+  if (pthread_mutex_init(&pool.lock, NULL) != 0) goto error_pool;
+  if (pthread_cond_init(&pool.cond, NULL) != 0) {
+    pthread_mutex_destroy(&pool.lock);
+    goto error_pool;
+  }
+  threads = (pthread_t *)malloc(sizeof(pthread_t) * workers);
+  if (threads == NULL) jc_oom("dedupe_parallel()");
+  for (; started < workers; started++)
+    if (pthread_create(&threads[started], NULL, dedupe_worker, &pool) != 0) break;
+  if (started == 0) {
+    free(threads);
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
+    goto error_pool;
+  }
+  LOUD(fprintf(stderr, "dedupefiles: %u workers for %zu sets\n", started, pool.cnt);)
+
+  /* Print each set's report in list order as soon as it is finished */
+  for (i = 0; i < pool.cnt; i++) {
+    struct dedupe_job * const job = &pool.jobs[i];
+
+    CLEARFLAG(job->head->flags, FF_HAS_DUPES);
+    pthread_mutex_lock(&pool.lock);
+    while (job->done == 0) pthread_cond_wait(&pool.cond, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+    if (job->outlen > 0) fwrite(job->out, 1, job->outlen, stdout);
+    fflush(stdout);
+    if (job->errlen > 0) fwrite(job->err, 1, job->errlen, stderr);
+    dedupe_explain(job->res.errors, explained);
+    if (job->res.failed != 0) exit_status = EXIT_FAILURE;
+    *total_files += job->res.files;
+    free(job->out);
+    free(job->err);
+  }
+
+  for (unsigned int t = 0; t < started; t++) pthread_join(threads[t], NULL);
+  free(threads);
+  pthread_cond_destroy(&pool.cond);
+  pthread_mutex_destroy(&pool.lock);
+  free(pool.jobs);
+  return 0;
+
+error_pool:
+  fprintf(stderr, "warning: cannot start dedupe workers; deduping one set at a time\n");
+  free(pool.jobs);
+  return -1;
+}
+#endif /* NO_THREADS */
+
 
-      /* Dedupe src <--> dest, 16 MiB or less at a time */
-      remain = dupefile->size;
-      fdri->status = FILE_DEDUPE_RANGE_SAME;
-      /* Consume data blocks until no data remains */
-      while (remain) {
-        errno = 0;
-        fdr->src_offset = (uint64_t)(dupefile->size - remain);
-        fdri->dest_offset = fdr->src_offset;
-        fdr->src_length = (uint64_t)(remain <= KERNEL_DEDUP_MAX_SIZE ? remain : KERNEL_DEDUP_MAX_SIZE);
-        ioctl(src_fd, FIDEDUPERANGE, fdr);
-        if (fdri->status < 0) break;
-        remain -= (off_t)fdr->src_length;
+/* Dedupe one run of identical blocks; returns bytes deduplicated or -1 */
+static off_t dedupe_run(const int src_fd, const int dst_fd, struct file_dedupe_range *fdr,
+    const struct dedupe_extmap *src_map, const struct dedupe_extmap *dst_map,
+    const off_t start, const off_t len, int * const restrict status)
+{
+  off_t done = 0, remain = len;
+
+  while (remain > 0) {
+    fdr->src_offset = (uint64_t)(start + len - remain);
+    fdr->src_length = (uint64_t)(remain <= KERNEL_DEDUP_MAX_SIZE ? remain : KERNEL_DEDUP_MAX_SIZE);
+    remain -= (off_t)fdr->src_length;
+    if (range_is_shared(src_map, dst_map, fdr->src_offset, fdr->src_length)) continue;
+    fdr->dest_count = 1;
+    fdr->info[0].dest_fd = dst_fd;
+    fdr->info[0].dest_offset = fdr->src_offset;
+    fdr->info[0].bytes_deduped = 0;
+    fdr->info[0].status = FILE_DEDUPE_RANGE_SAME;
+    fdr->info[0].reserved = 0;
+    PROBE4(dedupe_start, src_fd, fdr->src_offset, fdr->src_length, 1);
+    if (ioctl(src_fd, FIDEDUPERANGE, fdr) != 0) {
+      *status = -errno;
+      PROBE4(dedupe_done, src_fd, fdr->src_offset, fdr->src_length, *status);
+      return -1;
+    }
+    PROBE4(dedupe_done, src_fd, fdr->src_offset, fdr->src_length, 0);
+    if (fdr->info[0].status != FILE_DEDUPE_RANGE_SAME) {
+      *status = fdr->info[0].status;
+      return -1;
+    }
+    done += (off_t)fdr->info[0].bytes_deduped;
+  }
+  return done;
+}
+
+
+/* Read up to 'len' bytes at 'off'; returns the byte count read or -1 */
+static ssize_t dedupe_read(const int fd, char *buf, const size_t len, const off_t off)
+{
+  size_t got = 0;
+
+  while (got < len) {
+    const ssize_t i = pread(fd, buf + got, len - got, off + (off_t)got);
+    if (i < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    if (i == 0) break;
+    got += (size_t)i;
+  }
+  return (ssize_t)got;
+}
+
+
+/* Compare two same-size files in aligned blocks and dedupe each run of
+ * identical blocks; returns bytes deduplicated or -1 on error */
+static off_t dedupe_blocks_pair(file_t *src, file_t *dst, char *buf1, char *buf2,
+    const size_t bufsize, struct file_dedupe_range *fdr, int * const restrict status)
+{
+  struct dedupe_extmap *src_map = NULL, *dst_map = NULL;
+  off_t off = 0, run = -1, total = 0, i;
+  int src_fd, dst_fd;
+
+  *status = 0;
+  src_fd = open(src->d_name, O_RDONLY);
+  if (src_fd == -1) goto error_open;
+  dst_fd = open(dst->d_name, O_RDONLY);
+  if (dst_fd == -1) {
+    close(src_fd);
+    goto error_open;
+  }
+  posix_fadvise(src_fd, 0, src->size, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(dst_fd, 0, dst->size, POSIX_FADV_SEQUENTIAL);
+  src_map = get_extent_map(src_fd, src->size);
+  if (src_map != NULL) dst_map = get_extent_map(dst_fd, dst->size);
+
+  while (off < src->size) {
+    const ssize_t r1 = dedupe_read(src_fd, buf1, bufsize, off);
+    const ssize_t r2 = dedupe_read(dst_fd, buf2, bufsize, off);
+
+    if (r1 < 0 || r2 < 0) {
+      *status = -errno;
+      goto error_pair;
+    }
+    /* The file was truncated or extended since it was scanned */
+    if (r1 != r2 || r1 == 0) {
+      *status = FILE_DEDUPE_RANGE_DIFFERS;
+      goto error_pair;
+    }
+    for (ssize_t pos = 0; pos < r1; pos += DEDUPE_BLOCK_SIZE) {
+      const size_t len = (r1 - pos < DEDUPE_BLOCK_SIZE) ? (size_t)(r1 - pos) : DEDUPE_BLOCK_SIZE;
+      const int same = (memcmp(buf1 + pos, buf2 + pos, len) == 0);
+
+      if (same && run == -1) run = off + pos;
+      if (!same && run != -1) {
+        i = dedupe_run(src_fd, dst_fd, fdr, src_map, dst_map, run, off + pos - run, status);
+        if (i < 0) goto error_pair;
+        total += i;
+        run = -1;
       }
+    }
+    off += r1;
+  }
+  if (run != -1) {
+    i = dedupe_run(src_fd, dst_fd, fdr, src_map, dst_map, run, off - run, status);
+    if (i < 0) goto error_pair;
+    total += i;
+  }
+  free_extent_map(src_map);
+  free_extent_map(dst_map);
+  close(src_fd);
+  close(dst_fd);
+  return total;
+
+error_pair:
+  free_extent_map(src_map);
+  free_extent_map(dst_map);
+  close(src_fd);
+  close(dst_fd);
+  return -1;
+error_open:
+  *status = -errno;
+  return -1;
+}
+
+
+/* Order partial dedupe candidates so same-size files on the same device
+ * with the same partial hash end up next to each other */
+static int dedupe_blocks_cmp(const void *a, const void *b)
+{
+  const file_t * const f1 = *(file_t * const *)a;
+  const file_t * const f2 = *(file_t * const *)b;
+
+  if (f1->size != f2->size) return (f1->size < f2->size) ? -1 : 1;
+  if (f1->device != f2->device) return (f1->device < f2->device) ? -1 : 1;
+  if (f1->filehash_partial != f2->filehash_partial) return (f1->filehash_partial < f2->filehash_partial) ? -1 : 1;
+  return 0;
+}
+
+
+/* Partial-file dedupe: files of the same size that matched at the partial
+ * hash but not at the full hash may still share most of their blocks. Each
+ * such file is compared block by block with the others before it until one
+ * shares some blocks, and identical runs of blocks are deduplicated against
+ * that source. Only the head of each set of full duplicates takes part since
+ * the rest of the set is identical to it; dedupefiles() clears FF_NOT_UNIQUE
+ * on the heads before it consumes the sets. */
+static void dedupe_blocks(file_t *files, unsigned int * const restrict explained)
+{
+  struct dedupe_ctx ctx;
+  struct dedupe_result res;
+  file_t **list, *curfile;
+  const file_t *header = NULL;
+  char *buf1, *buf2;
+  size_t cnt = 0, alloc = 256, bufsize;
+  uintmax_t total_bytes = 0, total_files = 0;
+
+  LOUD(fprintf(stderr, "dedupe_blocks: %p\n", files);)
 
-      /* Handle any errors */
-      err = fdri->status;
-      if (err != FILE_DEDUPE_RANGE_SAME || errno != 0) {
-        printf("  -XX-> %s\n", dupefile->d_name);
-        fprintf(stderr, "error: ");
-        if (err == FILE_DEDUPE_RANGE_DIFFERS) {
-          fprintf(stderr, "not identical (files modified between scan and dedupe?)\n");
-          exit_status = EXIT_FAILURE;
-        } else if (err != 0) {
-          fprintf(stderr, "%s (%d)\n", strerror(-err), err);
-          exit_status = EXIT_FAILURE;
-        } else if (errno != 0) {
-          fprintf(stderr, "%s (%d)\n", strerror(errno), errno);
-          exit_status = EXIT_FAILURE;
+  list = (file_t **)malloc(sizeof(file_t *) * alloc);
+  if (list == NULL) jc_oom("dedupe_blocks()");
+  /* Files that were never partial hashed had no other file of their size */
+  for (curfile = files; curfile; curfile = curfile->next) {
+    if (ISFLAG(curfile->flags, FF_NOT_UNIQUE) || !ISFLAG(curfile->flags, FF_HASH_PARTIAL)
+        || curfile->size < DEDUPE_BLOCK_MIN_SIZE) continue;
+    if (cnt == alloc) {
+      alloc *= 2;
+      list = (file_t **)realloc(list, sizeof(file_t *) * alloc);
+      if (list == NULL) jc_oom("dedupe_blocks()");
+    }
+    list[cnt++] = curfile;
+  }
+  qsort(list, cnt, sizeof(file_t *), dedupe_blocks_cmp);
+
+  bufsize = (auto_chunk_size > DEDUPE_BLOCK_SIZE) ? auto_chunk_size - (auto_chunk_size % DEDUPE_BLOCK_SIZE) : DEDUPE_BLOCK_SIZE;
+  buf1 = (char *)malloc(bufsize);
+  buf2 = (char *)malloc(bufsize);
+  if (buf1 == NULL || buf2 == NULL) jc_oom("dedupe_blocks()");
+  alloc_dedupe_ctx(&ctx, 1);
+  memset(&res, 0, sizeof(struct dedupe_result));
+
+  for (size_t i = 0; i < cnt; ) {
+    size_t end = i + 1;
+
+    while (end < cnt && dedupe_blocks_cmp(&list[i], &list[end]) == 0) end++;
+    for (size_t j = i + 1; j < end; j++) {
+      file_t * const dst = list[j];
+
+      for (size_t k = i; k < j; k++) {
+        file_t * const src = list[k];
+        off_t bytes;
+        int status;
+
+        /* Hard links and full duplicates were already handled */
+        if (src->inode == dst->inode) break;
+        if (ISFLAG(src->flags, FF_HASH_FULL) && ISFLAG(dst->flags, FF_HASH_FULL)
+            && src->filehash == dst->filehash) break;
+        bytes = dedupe_blocks_pair(src, dst, buf1, buf2, bufsize, ctx.fdr, &status);
+        if (bytes == 0) continue;
+        if (header != src) {
+          if (header != NULL) printf("\n");
+          printf("  [SRC] %s\n", src->d_name);
+          header = src;
+        }
+        if (bytes > 0) {
+          printf("  =~~=> %s (%" PRIdMAX " of %" PRIdMAX " bytes)\n", dst->d_name, (intmax_t)bytes, (intmax_t)dst->size);
+          total_bytes += (uintmax_t)bytes;
+          total_files++;
+        } else {
+          dedupe_report_error(dst->d_name, status, 0, stdout, stderr, &res);
+          dedupe_explain(res.errors, explained);
         }
-        if ((err == -22 || errno == 22) && err_twentytwo == 0) {
-          fprintf(stderr, "       One or more files being deduped are read-only or hard linked.\n");
-          fprintf(stderr, "       Read-only files can only be deduped by the root user.\n");
-          fprintf(stderr, "       %s\n", s_err_dedupe_notabug);
-          fprintf(stderr, "       %s\n", s_err_dedupe_repeated);
-          err_twentytwo = 1;
-	}
-        if ((err == -95 || errno == 95) && err_ninetyfive == 0) {
-          fprintf(stderr, "       One or more files is on a filesystem that does not support\n");
-          fprintf(stderr, "       block-level deduplication or are on different filesystems.\n");
-          fprintf(stderr, "       %s\n", s_err_dedupe_notabug);
-          fprintf(stderr, "       %s\n", s_err_dedupe_repeated);
-          err_ninetyfive = 1;
-	}
-      } else {
-        /* Dedupe OK; report to the user and add to file count */
-        printf("  ====> %s\n", dupefile->d_name);
-        total_files++;
+        break;
       }
-      close((int)fdri->dest_fd);
     }
-    printf("\n");
-    close(src_fd);
-    total_files++;
+    i = end;
+  }
+  if (header != NULL) printf("\n");
+  if (res.failed != 0) exit_status = EXIT_FAILURE;
+  printf("Partial-file dedupe: %" PRIuMAX " bytes in %" PRIuMAX " files\n", total_bytes, total_files);
+
+  free_dedupe_ctx(&ctx);
+  free(buf1);
+  free(buf2);
+  free(list);
+  return;
+}
+#endif /* __linux__ */
+
+
+void dedupefiles(file_t * restrict files)
+{
+#ifdef __linux__
+  struct dedupe_ctx ctx;
+  struct rlimit rl;
+  file_t *curfile;
+  unsigned int explained = 0;
+  unsigned int workers = (worker_count > 0) ? worker_count : 1;
+  int max_dests = (int)KERNEL_DEDUP_MAX_DESTS;
+  uint64_t total_files = 0;
+
+  LOUD(fprintf(stderr, "\ndedupefiles: %p\n", files);)
+
+  /* Batch size is bounded by the kernel and by the open file limit, which
+   * is shared by all of the workers */
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+    rlim_t avail = (rl.rlim_cur > DEDUPE_FD_RESERVE) ? rl.rlim_cur - DEDUPE_FD_RESERVE : 1;
+    avail /= workers * 2;
+    if (avail < 1) avail = 1;
+    if (avail < (rlim_t)max_dests) max_dests = (int)avail;
   }
+  LOUD(fprintf(stderr, "dedupefiles: up to %d destinations per request\n", max_dests);)
 
+  /* Partial-file dedupe needs to know the sets before they are consumed;
+   * registerpair() marked every set member, so unmark the heads */
+  if (ISFLAG(a_flags, FA_DEDUPEBLOCKS)) {
+    for (curfile = files; curfile; curfile = curfile->next)
+      if (ISFLAG(curfile->flags, FF_HAS_DUPES)) CLEARFLAG(curfile->flags, FF_NOT_UNIQUE);
+  }
+
+#ifndef NO_THREADS
+  if (workers > 1 && dedupe_parallel(files, workers, max_dests, &total_files, &explained) == 0) goto dedupe_done;
+#endif
+
+  alloc_dedupe_ctx(&ctx, max_dests);
+  for (curfile = files; curfile; curfile = curfile->next) {
+    struct dedupe_result res;
+
+    /* Skip all files that have no duplicates */
+    if (!ISFLAG(curfile->flags, FF_HAS_DUPES)) continue;
+    CLEARFLAG(curfile->flags, FF_HAS_DUPES);
+
+    memset(&res, 0, sizeof(struct dedupe_result));
+    dedupe_set(curfile, &ctx, stdout, stderr, &res);
+    dedupe_explain(res.errors, &explained);
+    if (res.failed != 0) exit_status = EXIT_FAILURE;
+    total_files += res.files;
+  }
+  free_dedupe_ctx(&ctx);
+
+#ifndef NO_THREADS
+dedupe_done:
+#endif
+  if (ISFLAG(a_flags, FA_DEDUPEBLOCKS)) dedupe_blocks(files, &explained);
   if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "Deduplication done (%" PRIuMAX " files processed)\n", total_files);
-  free(fdr);
 #endif /* __linux__ */
 
 /* On macOS, clonefile() is basically a "hard link" function, so linkfiles will do the work. */
@@ -8,12 +8,21 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
+#include <errno.h>
+#ifndef ON_WINDOWS
+ #include <fcntl.h>
+ #include <unistd.h>
+#endif
+#ifndef NO_THREADS
+ #include <pthread.h>
+#endif
 
 #include <libjodycode.h>
 #include "jdupes.h"
 #include "likely_unlikely.h"
 #include "act_deletefiles.h"
 #include "act_linkfiles.h"
+#include "probes.h"
 #ifndef NO_HASHDB
  #include "hashdb.h"
 #endif
@@ -21,6 +30,32 @@
 /* For interactive deletion input */
 #define INPUT_SIZE 1024
 
+/* Non-interactive deletion handles this many files at a time */
+#ifndef DELETE_BATCH_SIZE
+ #define DELETE_BATCH_SIZE 65536
+#endif
+
+/* One file to delete and what happened to it */
+struct del_item {
+  file_t *file;
+  int result;  /* 0 = deleted, 1 = changed since scanned, 2 = delete failed */
+};
+
+/* One set of duplicates within a batch */
+struct del_set {
+  file_t *head;
+  size_t first, count;
+};
+
+struct del_work {
+  struct del_item **order;  /* items sorted by parent directory */
+  size_t cnt;
+  size_t next;
+#ifndef NO_THREADS
+  pthread_mutex_t lock;
+#endif
+};
+
 
 /* Count the following statistics:
    - Maximum number of files in a duplicate set (length of longest dupe chain)
@@ -48,10 +83,227 @@ static unsigned int get_max_dupes(const file_t *files, unsigned int * const rest
 }
 
 
+static size_t del_dirlen(const char * const restrict path)
+{
+  const char *slash = strrchr(path, '/');
+#ifdef ON_WINDOWS
+  const char *bslash = strrchr(path, '\\');
+  if (bslash > slash) slash = bslash;
+#endif
+  if (slash == NULL) return 0;
+  return (size_t)(slash - path);
+}
+
+
+/* Sort by directory so each directory is only opened once; the original
+ * order breaks ties so each directory is processed in set order */
+static int sort_del_dir(const void *a, const void *b)
+{
+  const struct del_item * const i1 = *(const struct del_item * const *)a;
+  const struct del_item * const i2 = *(const struct del_item * const *)b;
+  const size_t d1 = del_dirlen(i1->file->d_name);
+  const size_t d2 = del_dirlen(i2->file->d_name);
+  const int i = strncmp(i1->file->d_name, i2->file->d_name, (d1 < d2) ? d1 : d2);
+
+  if (i != 0) return i;
+  if (d1 != d2) return (d1 < d2) ? -1 : 1;
+  return (i1 < i2) ? -1 : (i1 > i2);
+}
+
+
+/* Delete runs of files that share a parent directory until none are left
+ * Each file still gets the file_has_changed() check right before removal */
+static void *del_worker(void *arg)
+{
+  struct del_work * const work = (struct del_work *)arg;
+  char dirbuf[PATHBUF_SIZE + 1];
+
+  while (1) {
+    size_t first, last, dirlen;
+    int dirfd = -1;
+
+#ifndef NO_THREADS
+    pthread_mutex_lock(&work->lock);
+#endif
+    first = work->next;
+    if (first >= work->cnt) {
+#ifndef NO_THREADS
+      pthread_mutex_unlock(&work->lock);
+#endif
+      break;
+    }
+    dirlen = del_dirlen(work->order[first]->file->d_name);
+    last = first + 1;
+    while (last < work->cnt && del_dirlen(work->order[last]->file->d_name) == dirlen
+        && strncmp(work->order[first]->file->d_name, work->order[last]->file->d_name, dirlen) == 0) last++;
+    work->next = last;
+#ifndef NO_THREADS
+    pthread_mutex_unlock(&work->lock);
+#endif
+
+#ifndef ON_WINDOWS
+    /* Open the parent directory once and unlink each name relative to it */
+    if (dirlen == 0 && work->order[first]->file->d_name[0] != '/') dirfd = AT_FDCWD;
+    else if (dirlen <= PATHBUF_SIZE) {
+      if (dirlen == 0) strcpy(dirbuf, "/");
+      else {
+        memcpy(dirbuf, work->order[first]->file->d_name, dirlen);
+        dirbuf[dirlen] = '\0';
+      }
+      dirfd = open(dirbuf, O_RDONLY | O_DIRECTORY);
+    }
+#else
+    (void)dirbuf;
+#endif
+
+    for (size_t i = first; i < last; i++) {
+      struct del_item * const item = work->order[i];
+      int err;
+
+      PROBE1(delete_start, item->file->d_name);
+      if (file_has_changed(item->file)) {
+        item->result = 1;
+        PROBE2(delete_done, item->file->d_name, item->result);
+        continue;
+      }
+#ifndef ON_WINDOWS
+      if (dirfd != -1) {
+        const char * const name = (dirfd == AT_FDCWD) ? item->file->d_name : item->file->d_name + dirlen + 1;
+        err = unlinkat(dirfd, name, 0);
+      } else
+#endif
+      err = jc_remove(item->file->d_name);
+      item->result = (err == 0) ? 0 : 2;
+      PROBE2(delete_done, item->file->d_name, item->result);
+    }
+#ifndef ON_WINDOWS
+    if (dirfd >= 0) close(dirfd);
+#endif
+  }
+  return NULL;
+}
+
+
+/* Delete one batch of sets, then report the results in set order */
+static void delete_batch(struct del_item * const restrict items, const size_t itemcnt,
+    const struct del_set * const restrict sets, const size_t setcnt)
+{
+  struct del_work work;
+  unsigned int workers = (worker_count > 0) ? worker_count : 1;
+
+  work.order = (struct del_item **)malloc(sizeof(struct del_item *) * (itemcnt + 1));
+  if (work.order == NULL) jc_oom("delete_batch()");
+  for (size_t i = 0; i < itemcnt; i++) work.order[i] = &items[i];
+  qsort(work.order, itemcnt, sizeof(struct del_item *), sort_del_dir);
+  work.cnt = itemcnt;
+  work.next = 0;
+
+#ifndef NO_THREADS
+  if (workers > itemcnt) workers = (unsigned int)itemcnt;
+  if (workers > 1 && pthread_mutex_init(&work.lock, NULL) == 0) {
+    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * workers);
+    unsigned int started = 0;
+
+    if (threads == NULL) jc_oom("delete_batch()");
+    for (; started < workers; started++)
+      if (pthread_create(&threads[started], NULL, del_worker, &work) != 0) break;
+    LOUD(fprintf(stderr, "delete_batch: %u workers for %zu files\n", started, itemcnt);)
+    /* If no thread could be started, this thread does all the work */
+    if (started == 0) del_worker(&work);
+    for (unsigned int t = 0; t < started; t++) pthread_join(threads[t], NULL);
+    free(threads);
+    pthread_mutex_destroy(&work.lock);
+  } else del_worker(&work);
+#else
+  (void)workers;
+  del_worker(&work);
+#endif /* NO_THREADS */
+  free(work.order);
+
+  for (size_t s = 0; s < setcnt; s++) {
+    printf("\n");
+    printf("   [+] "); jc_fwprint(stdout, sets[s].head->d_name, 1);
+    for (size_t i = sets[s].first; i < sets[s].first + sets[s].count; i++) {
+      file_t * const file = items[i].file;
+
+      if (items[i].result == 0) {
+        printf("   [-] "); jc_fwprint(stdout, file->d_name, 1);
+#ifndef NO_HASHDB
+        if (ISFLAG(flags, F_HASHDB)) {
+          file->mtime = 0;
+          add_hashdb_entry(NULL, 0, file);
+        }
+#endif
+      } else if (items[i].result == 1) {
+        printf("   [!] "); jc_fwprint(stdout, file->d_name, 0);
+        printf("-- file changed since being scanned\n");
+        exit_status = EXIT_FAILURE;
+      } else {
+        printf("   [!] "); jc_fwprint(stdout, file->d_name, 0);
+        printf("-- unable to delete file\n");
+        exit_status = EXIT_FAILURE;
+      }
+    }
+    printf("\n");
+  }
+  return;
+}
+
+
+/* Non-interactive deletion: keep the first file of each set and delete the
+ * rest in batches, grouped by directory and spread over -W workers */
+static void deletefiles_noprompt(file_t *files)
+{
+  struct del_item *items;
+  struct del_set *sets;
+  size_t itemcnt = 0, setcnt = 0, itemalloc = DELETE_BATCH_SIZE, setalloc = 1024;
+
+  items = (struct del_item *)malloc(sizeof(struct del_item) * itemalloc);
+  sets = (struct del_set *)malloc(sizeof(struct del_set) * setalloc);
+  if (items == NULL || sets == NULL) jc_oom("deletefiles() structures");
+
+  for (; files; files = files->next) {
+    if (!ISFLAG(files->flags, FF_HAS_DUPES)) continue;
+    if (setcnt == setalloc) {
+      setalloc *= 2;
+      sets = (struct del_set *)realloc(sets, sizeof(struct del_set) * setalloc);
+      if (sets == NULL) jc_oom("deletefiles() structures");
+    }
+    sets[setcnt].head = files;
+    sets[setcnt].first = itemcnt;
+    sets[setcnt].count = 0;
+    for (file_t *tmpfile = files->duplicates; tmpfile; tmpfile = tmpfile->duplicates) {
+      /* A set larger than a batch grows the batch */
+      if (itemcnt == itemalloc) {
+        itemalloc *= 2;
+        items = (struct del_item *)realloc(items, sizeof(struct del_item) * itemalloc);
+        if (items == NULL) jc_oom("deletefiles() structures");
+      }
+      items[itemcnt].file = tmpfile;
+      items[itemcnt].result = 0;
+      itemcnt++;
+      sets[setcnt].count++;
+    }
+    setcnt++;
+    if (itemcnt >= DELETE_BATCH_SIZE) {
+      delete_batch(items, itemcnt, sets, setcnt);
+      itemcnt = 0;
+      setcnt = 0;
+    }
+  }
+  if (setcnt > 0) delete_batch(items, itemcnt, sets, setcnt);
+
+  free(items);
+  free(sets);
+  return;
+}
+
+
 void deletefiles(file_t *files, int prompt, FILE *tty)
 {
   unsigned int counter, groups;
-  unsigned int curgroup = 0;
+  /* Stream mode calls this once per size group; keep counting across them */
+  static unsigned int curgroup = 0;
   file_t *tmpfile;
   file_t **dupelist;
   unsigned int *preserve;
@@ -63,6 +315,11 @@ void deletefiles(file_t *files, int prompt, FILE *tty)
 
   LOUD(fprintf(stderr, "deletefiles: %p, %d, %p\n", files, prompt, tty));
 
+  if (!prompt) {
+    deletefiles_noprompt(files);
+    return;
+  }
+
   groups = get_max_dupes(files, &max);
 
   max++;
@@ -79,29 +336,26 @@ void deletefiles(file_t *files, int prompt, FILE *tty)
       counter = 1;
       dupelist[counter] = files;
 
-      if (prompt) {
-        printf("[%u] ", counter); jc_fwprint(stdout, files->d_name, 1);
-      }
+      printf("[%u] ", counter); jc_fwprint(stdout, files->d_name, 1);
 
       tmpfile = files->duplicates;
 
       while (tmpfile) {
         dupelist[++counter] = tmpfile;
-        if (prompt) {
-          printf("[%u] ", counter); jc_fwprint(stdout, tmpfile->d_name, 1);
-        }
+        printf("[%u] ", counter); jc_fwprint(stdout, tmpfile->d_name, 1);
         tmpfile = tmpfile->duplicates;
       }
 
-      if (prompt) printf("\n");
+      printf("\n");
 
-      /* Preserve only the first file */
-      if (!prompt) {
-        preserve[1] = 1;
-        for (x = 2; x <= counter; x++) preserve[x] = 0;
-      } else do {
+      do {
         /* Prompt for files to preserve */
         printf("Specify multiple files with commas like this: 1,2,4,6\n");
+#ifndef NO_STREAM
+        /* The number of sets isn't known until the scan is over */
+        if (ISFLAG(flags, F_STREAM)) printf("Set %u: keep which files? (1 - %u, [a]ll, [n]one", curgroup, counter);
+        else
+#endif
         printf("Set %u of %u: keep which files? (1 - %u, [a]ll, [n]one", curgroup, groups, counter);
 #ifndef NO_HARDLINKS
        printf(", [l]ink all");
@@ -0,0 +1,174 @@
+/* Print a report of how candidates were narrowed down (--funnel)
+ * Files are grouped by size, then partial hashed, then full hashed, then
+ * compared; this shows how many were dropped at each step and how the
+ * size group sizes are spread out
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <libjodycode.h>
+#include "jdupes.h"
+#include "stats.h"
+#include "act_funnel.h"
+
+/* Group size buckets: 1, 2, 3-4, 5-8, ... 513-1024, 1025+ */
+#define FUNNEL_BUCKETS 12
+
+/* How far each file got before it was ruled out or matched */
+enum funnel_stage {
+  STAGE_UNREAD = 0,  /* Never read (e.g. hard links to a file already seen) */
+  STAGE_PARTIAL,     /* Ruled out by the partial hash */
+  STAGE_FULL,        /* Ruled out by the full or block hashes */
+  STAGE_DUPE,        /* Member of a duplicate set */
+  STAGE_COUNT
+};
+
+struct funnel_file {
+  off_t size;
+  enum funnel_stage stage;
+};
+
+struct funnel_bucket {
+  uintmax_t groups;
+  uintmax_t files[STAGE_COUNT];
+};
+
+static struct funnel_file *funnel = NULL;
+static size_t funnel_cnt = 0, funnel_max = 0;
+static uintmax_t funnel_sets = 0, funnel_dupe_bytes = 0;
+
+
+/* Record the files from 'files' through 'last' (or the end of the list)
+ * This must be called before the files are freed in stream mode */
+void funnel_add(const file_t * restrict files, const file_t * const restrict last)
+{
+  LOUD(fprintf(stderr, "funnel_add: %p\n", files));
+
+  for (; files != NULL; files = files->next) {
+    struct funnel_file *f;
+
+    if (funnel_cnt == funnel_max) {
+      funnel_max = (funnel_max == 0) ? 4096 : funnel_max * 2;
+      funnel = (struct funnel_file *)realloc(funnel, sizeof(struct funnel_file) * funnel_max);
+      if (funnel == NULL) jc_oom("funnel_add()");
+    }
+    f = &funnel[funnel_cnt++];
+    f->size = files->size;
+    /* Some actions clear FF_NOT_UNIQUE on the first file of each set */
+    if (ISFLAG(files->flags, FF_NOT_UNIQUE) || ISFLAG(files->flags, FF_HAS_DUPES)) f->stage = STAGE_DUPE;
+    /* Small files are fully read by the partial hash */
+    else if (files->size > PARTIAL_HASH_SIZE
+        && (ISFLAG(files->flags, FF_HASH_FULL) || files->blockhash != NULL)) f->stage = STAGE_FULL;
+    else if (ISFLAG(files->flags, FF_HASH_PARTIAL)) f->stage = STAGE_PARTIAL;
+    else f->stage = STAGE_UNREAD;
+
+    if (ISFLAG(files->flags, FF_HAS_DUPES)) {
+      const file_t *dupe;
+
+      funnel_sets++;
+      for (dupe = files->duplicates; dupe != NULL; dupe = dupe->duplicates)
+        funnel_dupe_bytes += (uintmax_t)files->size;
+    }
+    if (files == last) break;
+  }
+  return;
+}
+
+
+static int funnel_size_cmp(const void *a, const void *b)
+{
+  const off_t sa = ((const struct funnel_file *)a)->size;
+  const off_t sb = ((const struct funnel_file *)b)->size;
+
+  return (sa > sb) - (sa < sb);
+}
+
+
+static unsigned int funnel_bucket(const size_t count)
+{
+  unsigned int bucket = 0;
+  size_t limit = 1;
+
+  while (count > limit && bucket < FUNNEL_BUCKETS - 1) {
+    bucket++;
+    limit *= 2;
+  }
+  return bucket;
+}
+
+
+/* Print the report to stderr */
+void print_funnel(void)
+{
+  struct funnel_bucket buckets[FUNNEL_BUCKETS] = { { 0, { 0 } } };
+  uintmax_t groups = 0, by_size = 0, skipped = 0, dupes = 0, elim[STAGE_COUNT] = { 0 };
+  uintmax_t bytes_read = 0;
+  size_t i, j;
+  unsigned int b;
+
+  LOUD(fprintf(stderr, "print_funnel: %" PRIuMAX " files\n", (uintmax_t)funnel_cnt));
+
+  if (funnel_cnt > 1) qsort(funnel, funnel_cnt, sizeof(struct funnel_file), funnel_size_cmp);
+  for (i = 0; i < funnel_cnt; i = j) {
+    struct funnel_bucket *bucket;
+
+    for (j = i + 1; j < funnel_cnt && funnel[j].size == funnel[i].size; j++);
+    groups++;
+    bucket = &buckets[funnel_bucket(j - i)];
+    bucket->groups++;
+    if (j - i == 1) {
+      /* A file with a unique size can't have duplicates and is never read
+       * (it may still have hashes from the hash database) */
+      bucket->files[STAGE_UNREAD]++;
+      by_size++;
+      continue;
+    }
+    for (size_t k = i; k < j; k++) {
+      bucket->files[funnel[k].stage]++;
+      if (funnel[k].stage == STAGE_UNREAD) skipped++;
+      else if (funnel[k].stage == STAGE_DUPE) dupes++;
+      else elim[funnel[k].stage]++;
+    }
+  }
+  for (int p = PHASE_PARTIAL; p <= PHASE_CONFIRM; p++) bytes_read += run_stats.bytes[p];
+
+  fprintf(stderr, "\nCandidate funnel:\n");
+  fprintf(stderr, "  %-22s%12" PRIuMAX " in %" PRIuMAX " size groups\n", "files:", (uintmax_t)funnel_cnt, groups);
+  fprintf(stderr, "  %-22s%12" PRIuMAX "\n", "unique size:", by_size);
+  if (skipped != 0) fprintf(stderr, "  %-22s%12" PRIuMAX "\n", "not read:", skipped);
+  fprintf(stderr, "  %-22s%12" PRIuMAX " (%u partial hashes differed)\n", "partial hash:", elim[STAGE_PARTIAL], partial_elim);
+  fprintf(stderr, "  %-22s%12" PRIuMAX " (%u full/block hash compares)\n", "full hash:", elim[STAGE_FULL], full_hash);
+  if (hash_fail != 0) fprintf(stderr, "  %-22s%12u pairs with equal hashes but different contents\n", "byte compare:", hash_fail);
+  fprintf(stderr, "  %-22s%12" PRIuMAX " in %" PRIuMAX " sets, %" PRIuMAX " KiB in extra copies\n",
+      "duplicates:", dupes, funnel_sets, funnel_dupe_bytes >> 10);
+  fprintf(stderr, "  %-22s%12" PRIuMAX " KiB", "read:", bytes_read >> 10);
+  if (funnel_dupe_bytes != 0) {
+    const uintmax_t ratio = (bytes_read * 100) / funnel_dupe_bytes;
+
+    fprintf(stderr, ", %" PRIuMAX ".%02u bytes per duplicate byte\n", ratio / 100, (unsigned int)(ratio % 100));
+  } else fprintf(stderr, "\n");
+
+  fprintf(stderr, "\n  %-10s %10s %10s %10s %10s %10s %10s\n",
+      "group size", "groups", "files", "not read", "partial", "full", "dupes");
+  for (b = 0; b < FUNNEL_BUCKETS; b++) {
+    const struct funnel_bucket * const bucket = &buckets[b];
+    const size_t hi = (size_t)1 << b, lo = (b < 2) ? hi : hi / 2 + 1;
+    char label[24];
+
+    if (bucket->groups == 0) continue;
+    if (b == FUNNEL_BUCKETS - 1) snprintf(label, sizeof(label), "%" PRIuMAX "+", (uintmax_t)(hi / 2 + 1));
+    else if (lo == hi) snprintf(label, sizeof(label), "%" PRIuMAX, (uintmax_t)hi);
+    else snprintf(label, sizeof(label), "%" PRIuMAX "-%" PRIuMAX, (uintmax_t)lo, (uintmax_t)hi);
+    fprintf(stderr, "  %-10s %10" PRIuMAX " %10" PRIuMAX " %10" PRIuMAX " %10" PRIuMAX " %10" PRIuMAX " %10" PRIuMAX "\n",
+        label, bucket->groups,
+        bucket->files[STAGE_UNREAD] + bucket->files[STAGE_PARTIAL] + bucket->files[STAGE_FULL] + bucket->files[STAGE_DUPE],
+        bucket->files[STAGE_UNREAD], bucket->files[STAGE_PARTIAL], bucket->files[STAGE_FULL], bucket->files[STAGE_DUPE]);
+  }
+
+  free(funnel);
+  funnel = NULL;
+  funnel_cnt = funnel_max = 0;
+  return;
+}
@@ -0,0 +1,19 @@
+/* jdupes candidate funnel report (--funnel)
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef ACT_FUNNEL_H
+#define ACT_FUNNEL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+extern void funnel_add(const file_t * restrict files, const file_t * const restrict last);
+extern void print_funnel(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ACT_FUNNEL_H */
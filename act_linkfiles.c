@@ -1,6 +1,10 @@
 /* Hard link or symlink files
  * This file is part of jdupes; see jdupes.c for license information */
 
+#ifdef __linux__
+ /* O_PATH for the hard link fast path */
+ #define _GNU_SOURCE
+#endif
 #include "jdupes.h"
 
 /* Compile out the code if no linking support is built in */
@@ -10,9 +14,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#if !defined NO_HARDLINKS && !defined ON_WINDOWS
+ #include <fcntl.h>
+ #include <unistd.h>
+ /* Hard links replace the target with linkat() + renameat() in its directory */
+ #define LINK_AT_FAST_PATH 1
+#endif
 
 #include <libjodycode.h>
 #include "act_linkfiles.h"
+#include "probes.h"
 #ifndef NO_HASHDB
  #include "hashdb.h"
 #endif
@@ -64,6 +75,80 @@ static void revert_failed(const char * const restrict orig, const char * const r
 }
 
 
+#ifdef LINK_AT_FAST_PATH
+/* Parent directory of the last link target, kept open for the next one */
+static int linkdir_fd = -1;
+static size_t linkdir_len = 0;
+static char linkdir[PATHBUF_SIZE + 1];
+
+
+/* Return a directory fd for the parent of 'path' and point 'base' at the
+ * name within it; the fd is reused while targets share a directory */
+static int get_linkdir(const char * const restrict path, const char ** const restrict base)
+{
+  const char *slash = strrchr(path, '/');
+  size_t len;
+
+  if (slash == NULL) {
+    *base = path;
+    return AT_FDCWD;
+  }
+  *base = slash + 1;
+  len = (slash == path) ? 1 : (size_t)(slash - path);
+  if (len > PATHBUF_SIZE) return -1;
+  if (linkdir_fd != -1 && len == linkdir_len && strncmp(linkdir, path, len) == 0) return linkdir_fd;
+  if (linkdir_fd != -1) close(linkdir_fd);
+  memcpy(linkdir, path, len);
+  linkdir[len] = '\0';
+  linkdir_len = len;
+#ifdef O_PATH
+  /* O_PATH only needs search permission, like the path-based calls */
+  linkdir_fd = open(linkdir, O_PATH | O_DIRECTORY);
+#else
+  linkdir_fd = open(linkdir, O_RDONLY | O_DIRECTORY);
+#endif
+  if (linkdir_fd == -1) linkdir_len = 0;
+  return linkdir_fd;
+}
+
+
+/* Replace 'dst' with a hard link to 'src' in one step: link the source to a
+ * temporary name beside the target, then rename it over the target. The
+ * target name never disappears, and a failure leaves the target untouched.
+ * Returns 0 on success, -1 with errno set on failure, or 1 if the target's
+ * directory can't be opened and the caller should use the path-based code */
+static int hardlink_replace(const char * const restrict src, const char * const restrict dst)
+{
+  const char *base;
+  int dirfd, err;
+
+  dirfd = get_linkdir(dst, &base);
+  if (dirfd == -1) return 1;
+  if (strlen(base) + 16 > PATHBUF_SIZE) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(tempname, base);
+  strcat(tempname, ".__jdupes__.tmp");
+  if (linkat(AT_FDCWD, src, dirfd, tempname, 0) != 0) {
+    /* A temporary name left by an earlier run would be replaced by rename() */
+    if (errno != EEXIST || unlinkat(dirfd, tempname, 0) != 0) return -1;
+    if (linkat(AT_FDCWD, src, dirfd, tempname, 0) != 0) return -1;
+  }
+  if (renameat(dirfd, tempname, dirfd, base) != 0) {
+    err = errno;
+    if (unlinkat(dirfd, tempname, 0) != 0) {
+      fprintf(stderr, "\nwarning: couldn't remove temporary link ");
+      jc_fwprint(stderr, tempname, 1);
+    }
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+#endif /* LINK_AT_FAST_PATH */
+
+
 /* linktype: 0=symlink, 1=hardlink, 2=clonefile() */
 void linkfiles(file_t *files, const int linktype, const int only_current)
 {
@@ -277,6 +362,35 @@ void linkfiles(file_t *files, const int linktype, const int only_current)
         }
 #endif
 
+        PROBE3(link_start, srcfile->d_name, dupelist[x]->d_name, linktype);
+#ifdef LINK_AT_FAST_PATH
+        errno = 0;
+        if (linktype == 1 && (i = hardlink_replace(srcfile->d_name, dupelist[x]->d_name)) != 1) {
+          PROBE3(link_done, srcfile->d_name, dupelist[x]->d_name, i);
+          if (i == 0) {
+            if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+              printf("----> "); jc_fwprint(stdout, dupelist[x]->d_name, 1);
+            }
+ #ifndef NO_HASHDB
+            /* Delete the hashdb entry for new hard links */
+            if (ISFLAG(flags, F_HASHDB)) {
+              dupelist[x]->mtime = 0;
+              add_hashdb_entry(NULL, 0, dupelist[x]);
+            }
+ #endif
+          } else {
+            exit_status = EXIT_FAILURE;
+            if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+              printf("-//-> "); jc_fwprint(stdout, dupelist[x]->d_name, 1);
+            }
+            fprintf(stderr, "warning: unable to link '"); jc_fwprint(stderr, dupelist[x]->d_name, 0);
+            fprintf(stderr, "' -> '"); jc_fwprint(stderr, srcfile->d_name, 0);
+            fprintf(stderr, "': %s\n", strerror(errno));
+          }
+          continue;
+        }
+#endif /* LINK_AT_FAST_PATH */
+
         /* Make sure the name will fit in the buffer before trying */
         name_len = strlen(dupelist[x]->d_name) + 14;
         if (name_len > PATHBUF_SIZE) continue;
@@ -291,6 +405,7 @@ void linkfiles(file_t *files, const int linktype, const int only_current)
           exit_status = EXIT_FAILURE;
           /* Just in case the rename succeeded yet still returned an error, roll back the rename */
           jc_rename(tempname, dupelist[x]->d_name);
+          PROBE3(link_done, srcfile->d_name, dupelist[x]->d_name, -1);
           continue;
         }
 
@@ -328,6 +443,7 @@ void linkfiles(file_t *files, const int linktype, const int only_current)
           } else if (symlink(rel_path, dupelist[x]->d_name) == 0) success = 1;
         }
 #endif /* NO_SYMLINKS */
+        PROBE3(link_done, srcfile->d_name, dupelist[x]->d_name, success ? 0 : -1);
         if (success) {
           if (!ISFLAG(flags, F_HIDEPROGRESS)) {
             switch (linktype) {
@@ -395,6 +511,11 @@ linkfile_loop:
 
   if (counter == 0) printf("%s", s_no_dupes);
 
+#ifdef LINK_AT_FAST_PATH
+  if (linkdir_fd != -1) close(linkdir_fd);
+  linkdir_fd = -1;
+  linkdir_len = 0;
+#endif
   free(dupelist);
   return;
 }
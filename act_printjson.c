@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <time.h>
 
 #include <libjodycode.h>
 #include "likely_unlikely.h"
@@ -20,43 +21,50 @@
 #define GET_CONT(a) (a & 0x3f)
 #define TO_HEX(a) (char)(((a) & 0x0f) <= 0x09 ? ((a) & 0x0f) + 0x30 : ((a) & 0x0f) + 0x57)
 
-/** Decodes a single UTF-8 codepoint, consuming bytes. */
-static inline uint32_t decode_utf8(const char * restrict * const string) {
-  uint32_t ret = 0;
-  /** Eat problems up silently. */
-  assert(!IS_CONT(**string));
-  while (unlikely(IS_CONT(**string)))
-    (*string)++;
+/* NDJSON output is collected here and written in large blocks; it is also
+ * flushed once per second so consumers see sets while the scan goes on */
+#ifndef NDJSON_BUF_SIZE
+ #define NDJSON_BUF_SIZE 1048576
+#endif
 
-  /** ASCII. */
-  if (likely(!(**string & 0x80)))
-    return (uint32_t)*(*string)++;
+static char *ndjson_buf = NULL;
+static size_t ndjson_size = 0, ndjson_len = 0;
+static time_t ndjson_flushed = 0;
 
-  /** Multibyte 2, 3, 4. */
-  if ((**string & 0xe0) == 0xc0) {
-    ret = *(*string)++ & 0x1f;
-    ret = (ret << 6) | GET_CONT(*(*string)++);
-    return ret;
-  }
+/** Decodes a single UTF-8 codepoint, consuming bytes. Invalid, overlong or
+ *  truncated sequences consume one byte and return UTF8_INVALID. */
+#define UTF8_INVALID 0xffffffff
+static inline uint32_t decode_utf8(const char * restrict * const string) {
+  const unsigned char * const s = (const unsigned char *)*string;
+  uint32_t ret, min;
+  int len;
 
-  if ((**string & 0xf0) == 0xe0) {
-    ret = *(*string)++ & 0x0f;
-    ret = (ret << 6) | GET_CONT(*(*string)++);
-    ret = (ret << 6) | GET_CONT(*(*string)++);
-    return ret;
+  /** ASCII. */
+  if (likely(s[0] < 0x80)) {
+    (*string)++;
+    return s[0];
   }
 
-  if ((**string & 0xf8) == 0xf0) {
-    ret = *(*string)++ & 0x07;
-    ret = (ret << 6) | GET_CONT(*(*string)++);
-    ret = (ret << 6) | GET_CONT(*(*string)++);
-    ret = (ret << 6) | GET_CONT(*(*string)++);
-    return ret;
+  /** Multibyte 2, 3, 4. */
+  if ((s[0] & 0xe0) == 0xc0) {
+    len = 2; ret = s[0] & 0x1f; min = 0x80;
+  } else if ((s[0] & 0xf0) == 0xe0) {
+    len = 3; ret = s[0] & 0x0f; min = 0x800;
+  } else if ((s[0] & 0xf8) == 0xf0) {
+    len = 4; ret = s[0] & 0x07; min = 0x10000;
+  } else goto invalid;
+  /** A missing continuation byte (including the terminating NUL) ends it */
+  for (int i = 1; i < len; i++) {
+    if (!IS_CONT(s[i])) goto invalid;
+    ret = (ret << 6) | GET_CONT(s[i]);
   }
+  if (ret < min || ret > 0x10ffff || (ret >= 0xd800 && ret <= 0xdfff)) goto invalid;
+  *string += len;
+  return ret;
 
-  /** We shouldn't be here... Because 5 and 6 bytes are impossible... */
-  assert(0);
-  return 0xffffffff;
+invalid:
+  (*string)++;
+  return UTF8_INVALID;
 }
 
 /** Escapes a single UTF-16 code unit for JSON. */
@@ -69,36 +77,40 @@ static inline void escape_uni16(uint16_t u16, char ** const json) {
   *(*json)++ = TO_HEX(u16);
 }
 
-/** Escapes a UTF-8 string to ASCII JSON format. */
-static void json_escape(const char * restrict string, char * restrict const target)
+/** Escapes a UTF-8 string to ASCII JSON format; returns the end of the output.
+ *  Bytes that are not valid UTF-8 are written as \u00XX. Output stops early
+ *  rather than going past 'limit' bytes (including the terminating NUL). */
+char *json_escape(const char * restrict string, char * restrict const target, const size_t limit)
 {
-  uint32_t curr = 0;
   char *escaped = target;
-  while (*string != '\0' && (escaped - target) < (PATHBUF_SIZE * 2 - 1)) {
-    switch (*string) {
-      case '\"':
-      case '\\':
-        *escaped++ = '\\';
-        *escaped++ = *string++;
-        break;
-      default:
-	curr = decode_utf8(&string);
-	if (curr == 0xffffffff) break;
-	if (likely(curr < 0xffff)) {
-	  if (likely(curr < 0x20 || curr > 0x7f))
-	    escape_uni16((uint16_t)curr, &escaped);
-	  else
-	    *escaped++ = (char)curr;
-	} else {
-	  curr -= 0x10000;
-	  escape_uni16((uint16_t)(0xD800 + ((curr >> 10) & 0x03ff)), &escaped);
-	  escape_uni16((uint16_t)(0xDC00 + (curr & 0x03ff)), &escaped);
-	}
-        break;
+
+  while (*string != '\0') {
+    const size_t room = limit - (size_t)(escaped - target);
+    uint32_t curr;
+
+    if (*string == '\"' || *string == '\\') {
+      if (room < 3) break;
+      *escaped++ = '\\';
+      *escaped++ = *string++;
+      continue;
+    }
+    curr = decode_utf8(&string);
+    if (curr == UTF8_INVALID) curr = (unsigned char)string[-1];
+    if (curr >= 0x20 && curr <= 0x7f) {
+      if (room < 2) break;
+      *escaped++ = (char)curr;
+    } else if (curr <= 0xffff) {
+      if (room < 7) break;
+      escape_uni16((uint16_t)curr, &escaped);
+    } else {
+      if (room < 13) break;
+      curr -= 0x10000;
+      escape_uni16((uint16_t)(0xD800 + ((curr >> 10) & 0x03ff)), &escaped);
+      escape_uni16((uint16_t)(0xDC00 + (curr & 0x03ff)), &escaped);
     }
   }
   *escaped = '\0';
-  return;
+  return escaped;
 }
 
 void printjson(file_t * restrict files, const int argc, char **argv)
@@ -121,7 +133,7 @@ void printjson(file_t * restrict files, const int argc, char **argv)
     temp_insert += len;
     arg++;
   }
-  json_escape(temp + 1, temp2); /* Skip the starting space */
+  json_escape(temp + 1, temp2, PATHBUF_SIZE * 2); /* Skip the starting space */
   printf("%s\",\n", temp2);
   printf("  \"extensionFlags\": \"");
 #ifndef NO_HELPTEXT
@@ -138,14 +150,14 @@ void printjson(file_t * restrict files, const int argc, char **argv)
       if (comma) printf(",\n");
       printf("    {\n      \"fileSize\": %" PRIdMAX ",\n      \"fileList\": [\n        { \"filePath\": \"", (intmax_t)files->size);
       sprintf(temp, "%s", files->d_name);
-      json_escape(temp, temp2);
+      json_escape(temp, temp2, PATHBUF_SIZE * 2);
       jc_fwprint(stdout, temp2, 0);
       printf("\"");
       tmpfile = files->duplicates;
       while (tmpfile != NULL) {
         printf(" },\n        { \"filePath\": \"");
         sprintf(temp, "%s", tmpfile->d_name);
-        json_escape(temp, temp2);
+        json_escape(temp, temp2, PATHBUF_SIZE * 2);
         jc_fwprint(stdout, temp2, 0);
         printf("\"");
         tmpfile = tmpfile->duplicates;
@@ -162,4 +174,98 @@ void printjson(file_t * restrict files, const int argc, char **argv)
   return;
 }
 
+
+
+static void flush_ndjson(void)
+{
+  if (ndjson_len > 0) {
+    fwrite(ndjson_buf, 1, ndjson_len, stdout);
+    fflush(stdout);
+    ndjson_len = 0;
+  }
+  ndjson_flushed = time(NULL);
+  return;
+}
+
+
+/* Make room for 'need' more bytes in the NDJSON buffer */
+static char *ndjson_reserve(const size_t need)
+{
+  if (ndjson_len + need > ndjson_size) {
+    flush_ndjson();
+    if (need > ndjson_size) {
+      ndjson_size = (need > NDJSON_BUF_SIZE) ? need : NDJSON_BUF_SIZE;
+      free(ndjson_buf);
+      ndjson_buf = (char *)malloc(ndjson_size);
+      if (unlikely(ndjson_buf == NULL)) jc_oom("ndjson_reserve()");
+    }
+  }
+  return ndjson_buf + ndjson_len;
+}
+
+
+static void ndjson_hash(const char * const restrict name, const uint64_t hash, const int valid)
+{
+  char *out = ndjson_reserve(48);
+
+  if (valid) ndjson_len += (size_t)sprintf(out, ",\"%s\":\"%016" PRIx64 "\"", name, hash);
+  else ndjson_len += (size_t)sprintf(out, ",\"%s\":null", name);
+  return;
+}
+
+
+/* Print each match set as one line of JSON (-J/--ndjson) */
+void printndjson(file_t * restrict files)
+{
+  file_t * restrict tmpfile;
+  char *out;
+
+  LOUD(fprintf(stderr, "printndjson: %p\n", files));
+
+  for (; files != NULL; files = files->next) {
+    if (!ISFLAG(files->flags, FF_HAS_DUPES)) continue;
+    out = ndjson_reserve(48);
+    ndjson_len += (size_t)sprintf(out, "{\"fileSize\":%" PRIdMAX, (intmax_t)files->size);
+    ndjson_hash("partialHash", files->filehash_partial, ISFLAG(files->flags, FF_HASH_PARTIAL));
+    ndjson_hash("fullHash", files->filehash, ISFLAG(files->flags, FF_HASH_FULL));
+    out = ndjson_reserve(16);
+    ndjson_len += (size_t)sprintf(out, ",\"fileList\":[");
+    for (tmpfile = files; tmpfile != NULL; tmpfile = tmpfile->duplicates) {
+      /* Escaping can turn each input byte into at most six output bytes */
+      const size_t escmax = strlen(tmpfile->d_name) * 6 + 1;
+
+      out = ndjson_reserve(escmax + 96);
+      out += sprintf(out, "%s{\"filePath\":\"", (tmpfile == files) ? "" : ",");
+      out = json_escape(tmpfile->d_name, out, escmax);
+      out += sprintf(out, "\",\"inode\":%" PRIuMAX ",\"device\":%" PRIuMAX "}",
+          (uintmax_t)tmpfile->inode, (uintmax_t)tmpfile->device);
+      ndjson_len = (size_t)(out - ndjson_buf);
+    }
+    out = ndjson_reserve(4);
+    ndjson_len += (size_t)sprintf(out, "]}\n");
+  }
+  if (ndjson_len >= ndjson_size / 2 || time(NULL) != ndjson_flushed) flush_ndjson();
+  return;
+}
+
+
+/* Flush sets that have waited since the last second began; called between
+ * files so output doesn't sit in the buffer while no new sets turn up */
+void tick_ndjson(void)
+{
+  if (ndjson_len != 0 && time(NULL) != ndjson_flushed) flush_ndjson();
+  return;
+}
+
+
+/* Write out anything still buffered by printndjson() */
+void finish_ndjson(void)
+{
+  flush_ndjson();
+  free(ndjson_buf);
+  ndjson_buf = NULL;
+  ndjson_size = 0;
+  return;
+}
+
 #endif /* NO_JSON */
@@ -11,7 +11,11 @@ extern "C" {
 #endif
 
 #include "jdupes.h"
+char *json_escape(const char * restrict string, char * restrict const target, const size_t limit);
 void printjson(file_t * restrict files, const int argc, char ** const restrict argv);
+void printndjson(file_t * restrict files);
+void tick_ndjson(void);
+void finish_ndjson(void);
 
 #ifdef __cplusplus
 }
@@ -4,10 +4,163 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <time.h>
+#ifndef ON_WINDOWS
+ #include <errno.h>
+ #include <limits.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <sys/uio.h>
+#endif
 #include "jdupes.h"
 #include <libjodycode.h>
+#include "likely_unlikely.h"
 #include "act_printmatches.h"
 
+#ifndef ON_WINDOWS
+/* Output is gathered as an iovec list and written with writev(). File names
+ * are referenced in place; sizes, separators and (when streaming, since the
+ * files are freed after each group) names are copied into a staging buffer.
+ * Streamed output is also written out once a second so that results don't
+ * wait for the buffer to fill. */
+#ifndef OUT_BUF_SIZE
+ #define OUT_BUF_SIZE 262144
+#endif
+#if defined IOV_MAX && IOV_MAX < 1024
+ #define OUT_IOV_MAX IOV_MAX
+#else
+ #define OUT_IOV_MAX 1024
+#endif
+
+static struct iovec out_iov[OUT_IOV_MAX];
+static int out_iovcnt = 0;
+static char *out_buf = NULL;
+static size_t out_len = 0;
+static int out_error = 0;
+static time_t out_flushed = 0;
+
+
+static void out_flush(void)
+{
+  struct iovec *iov = out_iov;
+  int cnt = out_iovcnt;
+
+  while (cnt > 0 && out_error == 0) {
+    ssize_t written = writev(STDOUT_FILENO, iov, cnt);
+
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      out_error = 1;
+      break;
+    }
+    /* Skip over whatever a short write managed to send */
+    while (cnt > 0 && (size_t)written >= iov->iov_len) {
+      written -= (ssize_t)iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if (cnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= (size_t)written;
+    }
+  }
+  out_iovcnt = 0;
+  out_len = 0;
+  out_flushed = time(NULL);
+  return;
+}
+
+
+static void out_add(const char *s, const size_t len, const int copy)
+{
+  if (len == 0) return;
+  if (out_buf == NULL) {
+    out_buf = (char *)malloc(OUT_BUF_SIZE);
+    if (unlikely(out_buf == NULL)) jc_oom("out_add()");
+    /* Anything printed through stdio so far must come first */
+    fflush(stdout);
+  }
+  if (out_iovcnt == OUT_IOV_MAX || (copy && out_len + len > OUT_BUF_SIZE)) out_flush();
+  if (!copy || len > OUT_BUF_SIZE) {
+    out_iov[out_iovcnt].iov_base = (void *)(uintptr_t)s;
+    out_iov[out_iovcnt].iov_len = len;
+    out_iovcnt++;
+    /* Too big to stage, so it must go out before the caller frees it */
+    if (copy) out_flush();
+    return;
+  }
+  memcpy(out_buf + out_len, s, len);
+  /* Extend the previous entry if it ends where this copy begins */
+  if (out_iovcnt > 0 && (char *)out_iov[out_iovcnt - 1].iov_base + out_iov[out_iovcnt - 1].iov_len == out_buf + out_len) {
+    out_iov[out_iovcnt - 1].iov_len += len;
+  } else {
+    out_iov[out_iovcnt].iov_base = out_buf + out_len;
+    out_iov[out_iovcnt].iov_len = len;
+    out_iovcnt++;
+  }
+  out_len += len;
+  return;
+}
+
+
+static void print_name(const char * const restrict name, const int cr)
+{
+  out_add(name, strlen(name), ISFLAG(flags, F_STREAM));
+  out_add((cr == 2) ? "\0" : "\n", 1, 1);
+  return;
+}
+
+
+static void print_size(const off_t size)
+{
+  char temp[64];
+  const int len = snprintf(temp, sizeof(temp), "%" PRIdMAX " byte%c each:\n", (intmax_t)size, (size != 1) ? 's' : ' ');
+
+  out_add(temp, (size_t)len, 1);
+  return;
+}
+
+
+/* Write out streamed groups that have waited since the last second began;
+ * called after each group and between files (--stream) */
+void tick_printmatches(void)
+{
+  if (out_iovcnt != 0 && time(NULL) != out_flushed) out_flush();
+  return;
+}
+
+
+/* Write out any output still held back for the next group (--stream) */
+void flush_printmatches(void)
+{
+  out_flush();
+  free(out_buf);
+  out_buf = NULL;
+  return;
+}
+
+#else
+ #define print_name(a,b) jc_fwprint(stdout, a, b)
+ #define print_size(a) printf("%" PRIdMAX " byte%c each:\n", (intmax_t)a, (a != 1) ? 's' : ' ')
+ #define out_flush()
+static time_t out_flushed = 0;
+
+void tick_printmatches(void)
+{
+  const time_t now = time(NULL);
+
+  if (now != out_flushed) {
+    fflush(stdout);
+    out_flushed = now;
+  }
+  return;
+}
+
+void flush_printmatches(void) { return; }
+#endif /* ON_WINDOWS */
+
+
 void printmatches(file_t * restrict files)
 {
   file_t * restrict tmpfile;
@@ -22,32 +175,34 @@ void printmatches(file_t * restrict files)
     if (ISFLAG(files->flags, FF_HAS_DUPES)) {
       printed = 1;
       if (!ISFLAG(a_flags, FA_OMITFIRST)) {
-        if (ISFLAG(a_flags, FA_SHOWSIZE)) printf("%" PRIdMAX " byte%c each:\n", (intmax_t)files->size,
-            (files->size != 1) ? 's' : ' ');
-        jc_fwprint(stdout, files->d_name, cr);
+        if (ISFLAG(a_flags, FA_SHOWSIZE)) print_size(files->size);
+        print_name(files->d_name, cr);
       }
       tmpfile = files->duplicates;
       while (tmpfile != NULL) {
-        jc_fwprint(stdout, tmpfile->d_name, cr);
+        print_name(tmpfile->d_name, cr);
         tmpfile = tmpfile->duplicates;
       }
-      if (files->next != NULL) jc_fwprint(stdout, "", cr);
+      if (files->next != NULL) print_name("", cr);
 
     }
 
     files = files->next;
   }
 
+  /* Streamed groups share one buffer that is written out as it fills */
+  if (!ISFLAG(flags, F_STREAM)) out_flush();
+  else tick_printmatches();
   if (printed == 0) printf("%s", s_no_dupes);
 
   return;
 }
 
 
-/* Print files that have no duplicates (unique files) */
+/* Print files that have no duplicates (unique files)
+ * Every file in a match set was marked FF_NOT_UNIQUE by registerpair() */
 void printunique(file_t *files)
 {
-  file_t *chain, *scan;
   int printed = 0;
   int cr = 1;
 
@@ -55,27 +210,15 @@ void printunique(file_t *files)
 
   if (ISFLAG(a_flags, FA_PRINTNULL)) cr = 2;
 
-  scan = files;
-  while (scan != NULL) {
-    if (ISFLAG(scan->flags, FF_HAS_DUPES)) {
-      chain = scan;
-      while (chain != NULL) {
-        SETFLAG(chain->flags, FF_NOT_UNIQUE);
-	chain = chain->duplicates;
-      }
-    }
-    scan = scan->next;
-  }
-
   while (files != NULL) {
     if (!ISFLAG(files->flags, FF_NOT_UNIQUE)) {
       printed = 1;
-      if (ISFLAG(a_flags, FA_SHOWSIZE)) printf("%" PRIdMAX " byte%c each:\n", (intmax_t)files->size,
-          (files->size != 1) ? 's' : ' ');
-      jc_fwprint(stdout, files->d_name, cr);
+      if (ISFLAG(a_flags, FA_SHOWSIZE)) print_size(files->size);
+      print_name(files->d_name, cr);
     }
     files = files->next;
   }
+  out_flush();
 
   if (printed == 0) jc_fwprint(stderr, "No unique files found.", 1);
 
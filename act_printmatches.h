@@ -11,6 +11,8 @@ extern "C" {
 #include "jdupes.h"
 void printmatches(file_t * restrict files);
 void printunique(file_t *files);
+void tick_printmatches(void);
+void flush_printmatches(void);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,278 @@
+/* Find files that share most of their content with content-defined chunking
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef NO_SIMILAR
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <libjodycode.h>
+#include "likely_unlikely.h"
+#include "jdupes.h"
+#include "filehash.h"
+#ifndef NO_XXHASH2
+ #include "xxhash.h"
+#endif
+#include "act_printsimilar.h"
+
+/* Chunk boundaries fall where the rolling hash has SIMILAR_CHUNK_BITS
+ * zero bits, giving chunks of about SIMILAR_CHUNK_MIN + 2^BITS bytes */
+#ifndef SIMILAR_CHUNK_BITS
+ #define SIMILAR_CHUNK_BITS 13
+#endif
+#ifndef SIMILAR_CHUNK_MIN
+ #define SIMILAR_CHUNK_MIN 2048
+#endif
+#ifndef SIMILAR_CHUNK_MAX
+ #define SIMILAR_CHUNK_MAX 65536
+#endif
+#define SIMILAR_CHUNK_MASK ((UINT64_C(1) << SIMILAR_CHUNK_BITS) - 1)
+/* Files smaller than this have too few chunks to compare */
+#ifndef SIMILAR_MIN_SIZE
+ #define SIMILAR_MIN_SIZE 16384
+#endif
+/* Chunks found in more files than this (runs of zeroes, common headers)
+ * say nothing about similarity and would make pairing quadratic */
+#ifndef SIMILAR_MAX_SHARERS
+ #define SIMILAR_MAX_SHARERS 32
+#endif
+
+/* Percentage of the smaller file that must be shared (-c/--similar) */
+unsigned int similar_percent = 50;
+
+struct sim_chunk {
+  uint64_t hash;
+  uint32_t file;
+  uint32_t len;
+};
+
+struct sim_pair {
+  uint32_t a, b;
+  uint64_t shared;
+};
+
+/* Gear table for the rolling hash */
+static uint64_t gear[256];
+
+static struct sim_chunk *chunks = NULL;
+static size_t chunkcnt = 0, chunkalloc = 0;
+
+
+static void init_gear(void)
+{
+  uint64_t x = UINT64_C(0x6a09e667f3bcc908);
+
+  /* splitmix64 gives a fixed, well-mixed table */
+  for (int i = 0; i < 256; i++) {
+    uint64_t z = (x += UINT64_C(0x9e3779b97f4a7c15));
+    z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+    gear[i] = z ^ (z >> 31);
+  }
+  return;
+}
+
+
+static uint64_t hash_chunk(const uint64_t * const restrict data, const size_t len)
+{
+  uint64_t hash = 0;
+
+#ifndef NO_XXHASH2
+  if (hash_algo == HASH_ALGO_XXHASH2_64) return XXH64(data, len, 0);
+#endif
+  if (jc_block_hash(NORMAL, data, &hash, len) != 0) return 0;
+  return hash;
+}
+
+
+static void add_chunk(const uint64_t hash, const uint32_t file, const uint32_t len)
+{
+  if (chunkcnt == chunkalloc) {
+    chunkalloc = (chunkalloc == 0) ? 65536 : chunkalloc * 2;
+    chunks = (struct sim_chunk *)realloc(chunks, sizeof(struct sim_chunk) * chunkalloc);
+    if (unlikely(chunks == NULL)) jc_oom("add_chunk()");
+  }
+  chunks[chunkcnt].hash = hash;
+  chunks[chunkcnt].file = file;
+  chunks[chunkcnt].len = len;
+  chunkcnt++;
+  return;
+}
+
+
+static int cmp_chunks(const void *a, const void *b)
+{
+  const struct sim_chunk * const c1 = (const struct sim_chunk *)a;
+  const struct sim_chunk * const c2 = (const struct sim_chunk *)b;
+
+  if (c1->hash != c2->hash) return (c1->hash < c2->hash) ? -1 : 1;
+  if (c1->file != c2->file) return (c1->file < c2->file) ? -1 : 1;
+  return 0;
+}
+
+
+static int cmp_pairs(const void *a, const void *b)
+{
+  const struct sim_pair * const p1 = (const struct sim_pair *)a;
+  const struct sim_pair * const p2 = (const struct sim_pair *)b;
+
+  if (p1->a != p2->a) return (p1->a < p2->a) ? -1 : 1;
+  if (p1->b != p2->b) return (p1->b < p2->b) ? -1 : 1;
+  return 0;
+}
+
+
+static int cmp_shared(const void *a, const void *b)
+{
+  const struct sim_pair * const p1 = (const struct sim_pair *)a;
+  const struct sim_pair * const p2 = (const struct sim_pair *)b;
+
+  if (p1->shared != p2->shared) return (p1->shared > p2->shared) ? -1 : 1;
+  return cmp_pairs(a, b);
+}
+
+
+/* Split a file into content-defined chunks and add their hashes to the index
+ * Boundaries depend on the content rather than on offsets, so data inserted
+ * or appended to a file only changes the chunks around the change */
+static int chunk_file(const file_t * const restrict file, const uint32_t idx,
+    char * const restrict buf, uint64_t * const restrict chunk)
+{
+  char * const cbuf = (char *)chunk;
+  FILE *fp;
+  size_t len = 0, r;
+  uint64_t roll = 0;
+  const size_t first = chunkcnt;
+
+  fp = jc_fopen(file->d_name, JC_FILE_MODE_RDONLY_SEQ);
+  if (fp == NULL) {
+    LOUD(fprintf(stderr, "chunk_file: warning: file open failed ('%s')\n", file->d_name);)
+    return -1;
+  }
+  while ((r = fread(buf, 1, auto_chunk_size, fp)) > 0) {
+    for (size_t i = 0; i < r; i++) {
+      cbuf[len++] = buf[i];
+      roll = (roll << 1) + gear[(unsigned char)buf[i]];
+      if (len < SIMILAR_CHUNK_MIN) continue;
+      if ((roll & SIMILAR_CHUNK_MASK) != 0 && len < SIMILAR_CHUNK_MAX) continue;
+      add_chunk(hash_chunk(chunk, len), idx, (uint32_t)len);
+      len = 0;
+      roll = 0;
+    }
+  }
+  if (len > 0) add_chunk(hash_chunk(chunk, len), idx, (uint32_t)len);
+  fclose(fp);
+
+  /* A chunk repeated inside one file only counts once */
+  if (chunkcnt - first > 1) {
+    size_t j = first;
+
+    qsort(chunks + first, chunkcnt - first, sizeof(struct sim_chunk), cmp_chunks);
+    for (size_t i = first + 1; i < chunkcnt; i++)
+      if (chunks[i].hash != chunks[j].hash) chunks[++j] = chunks[i];
+    chunkcnt = j + 1;
+  }
+  return 0;
+}
+
+
+void printsimilar(file_t *files)
+{
+  file_t **list = NULL, *curfile;
+  struct sim_pair *pairs = NULL;
+  size_t listcnt = 0, listalloc = 0, paircnt = 0, pairalloc = 0, printed = 0;
+  char *buf;
+  uint64_t *chunk;
+
+  LOUD(fprintf(stderr, "printsimilar: %p\n", files));
+
+  /* Full duplicates are represented by the first file of their set; the
+   * other members keep the FF_NOT_UNIQUE mark from registerpair() */
+  for (curfile = files; curfile != NULL; curfile = curfile->next)
+    if (ISFLAG(curfile->flags, FF_HAS_DUPES)) CLEARFLAG(curfile->flags, FF_NOT_UNIQUE);
+
+  init_gear();
+  buf = (char *)malloc(auto_chunk_size);
+  chunk = (uint64_t *)malloc(SIMILAR_CHUNK_MAX);
+  if (unlikely(buf == NULL || chunk == NULL)) jc_oom("printsimilar()");
+
+  for (curfile = files; curfile != NULL; curfile = curfile->next) {
+    if (ISFLAG(curfile->flags, FF_NOT_UNIQUE) || curfile->size < SIMILAR_MIN_SIZE) continue;
+    if (listcnt == listalloc) {
+      listalloc = (listalloc == 0) ? 256 : listalloc * 2;
+      list = (file_t **)realloc(list, sizeof(file_t *) * listalloc);
+      if (unlikely(list == NULL)) jc_oom("printsimilar()");
+    }
+    if (chunk_file(curfile, (uint32_t)listcnt, buf, chunk) == 0) list[listcnt++] = curfile;
+  }
+  free(buf);
+  free(chunk);
+  LOUD(fprintf(stderr, "printsimilar: %zu files, %zu chunks\n", listcnt, chunkcnt));
+
+  /* Every pair of files sharing a chunk is credited with its length */
+  qsort(chunks, chunkcnt, sizeof(struct sim_chunk), cmp_chunks);
+  for (size_t i = 0; i < chunkcnt; ) {
+    size_t end = i + 1;
+
+    while (end < chunkcnt && chunks[end].hash == chunks[i].hash) end++;
+    if (end - i > 1 && end - i <= SIMILAR_MAX_SHARERS) {
+      for (size_t a = i; a < end; a++) for (size_t b = a + 1; b < end; b++) {
+        if (paircnt == pairalloc) {
+          pairalloc = (pairalloc == 0) ? 4096 : pairalloc * 2;
+          pairs = (struct sim_pair *)realloc(pairs, sizeof(struct sim_pair) * pairalloc);
+          if (unlikely(pairs == NULL)) jc_oom("printsimilar()");
+        }
+        pairs[paircnt].a = chunks[a].file;
+        pairs[paircnt].b = chunks[b].file;
+        pairs[paircnt].shared = chunks[a].len;
+        paircnt++;
+      }
+    }
+    i = end;
+  }
+  free(chunks);
+  chunks = NULL;
+  chunkcnt = chunkalloc = 0;
+
+  /* Merge the credits for each pair and keep the pairs over the threshold */
+  if (paircnt > 0) {
+    size_t j = 0;
+
+    qsort(pairs, paircnt, sizeof(struct sim_pair), cmp_pairs);
+    for (size_t i = 1; i < paircnt; i++) {
+      if (cmp_pairs(&pairs[i], &pairs[j]) == 0) pairs[j].shared += pairs[i].shared;
+      else pairs[++j] = pairs[i];
+    }
+    paircnt = j + 1;
+    j = 0;
+    for (size_t i = 0; i < paircnt; i++) {
+      const off_t smaller = (list[pairs[i].a]->size < list[pairs[i].b]->size) ? list[pairs[i].a]->size : list[pairs[i].b]->size;
+      if (pairs[i].shared * 100 >= (uint64_t)smaller * similar_percent) pairs[j++] = pairs[i];
+    }
+    paircnt = j;
+    qsort(pairs, paircnt, sizeof(struct sim_pair), cmp_shared);
+  }
+
+  for (size_t i = 0; i < paircnt; i++) {
+    const file_t * const f1 = list[pairs[i].a];
+    const file_t * const f2 = list[pairs[i].b];
+    const off_t smaller = (f1->size < f2->size) ? f1->size : f2->size;
+
+    printf("%" PRIu64 "%% similar, %" PRIu64 " bytes shared:\n",
+        (pairs[i].shared * 100) / (uint64_t)smaller, pairs[i].shared);
+    jc_fwprint(stdout, f1->d_name, 1);
+    jc_fwprint(stdout, f2->d_name, 1);
+    printf("\n");
+    printed++;
+  }
+  if (printed == 0) printf("No similar files found.\n");
+
+  free(pairs);
+  free(list);
+  return;
+}
+
+#endif /* NO_SIMILAR */
@@ -0,0 +1,23 @@
+/* jdupes action for printing files that share most of their content
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef NO_SIMILAR
+
+#ifndef ACT_PRINTSIMILAR_H
+#define ACT_PRINTSIMILAR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+extern unsigned int similar_percent;
+void printsimilar(file_t *files);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ACT_PRINTSIMILAR_H */
+
+#endif /* NO_SIMILAR */
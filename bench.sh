@@ -0,0 +1,130 @@
+#!/bin/sh
+
+# Benchmark jdupes on a generated file tree ('make bench')
+#
+# A deterministic tree is built with bench_gentree, then jdupes is run
+# under each profile below. Wall time, peak RSS and I/O call counts come
+# from jdupes --stats-json; if strace is installed the total number of
+# system calls is counted in an extra run. Results are written as
+# tab-separated values, one line per run.
+#
+# Settings (environment variables):
+#   JDUPES         binary to test (default ./jdupes)
+#   BENCH_DIR      where the tree is generated (default bench_tree)
+#   BENCH_GEN      bench_gentree options (default "-n 20000 -M 4194304")
+#   BENCH_RUNS     runs per profile (default 3)
+#   BENCH_RESULTS  results file (default bench_results.tsv)
+#   BENCH_PROFILES space-separated profile names to run (default: all)
+#   BENCH_COLD     set to 1 to run jdupes with --cold-cache so every file
+#                  is read from the disk
+
+JDUPES="${JDUPES:-./jdupes}"
+GENTREE="${GENTREE:-./bench_gentree}"
+BENCH_DIR="${BENCH_DIR:-bench_tree}"
+BENCH_GEN="${BENCH_GEN:--n 20000 -M 4194304}"
+BENCH_RUNS="${BENCH_RUNS:-3}"
+BENCH_RESULTS="${BENCH_RESULTS:-bench_results.tsv}"
+BENCH_PROFILES="${BENCH_PROFILES:-recurse quick blockhash dedupe link hashdb-cold hashdb-warm}"
+COLD=""
+test "$BENCH_COLD" = "1" && COLD="--cold-cache"
+
+STATS="$BENCH_DIR.stats.json"
+HASHDB="$BENCH_DIR.hashdb"
+STAMP="$BENCH_DIR.gen"
+
+test ! -x "$JDUPES" && echo "Build jdupes first, silly" >&2 && exit 1
+test ! -x "$GENTREE" && echo "error: $GENTREE not found; run 'make bench'" >&2 && exit 1
+
+# (Re)generate the tree; the stamp file records the options it was made with
+gen_tree () {
+	if [ "$1" = "force" ] || [ ! -d "$BENCH_DIR" ] || [ "$(cat "$STAMP" 2>/dev/null)" != "$BENCH_GEN" ]
+		then rm -rf "$BENCH_DIR" "$STAMP"
+		# shellcheck disable=SC2086
+		$GENTREE $BENCH_GEN "$BENCH_DIR" >&2 || exit 1
+		echo "$BENCH_GEN" > "$STAMP"
+	fi
+}
+
+# Options for each profile
+profile_opts () {
+	case "$1" in
+		recurse) echo "-r" ;;
+		quick) echo "-rQ" ;;
+		blockhash) echo "-rb" ;;
+		dedupe) echo "-rB" ;;
+		link) echo "-rL" ;;
+		hashdb-cold|hashdb-warm) echo "-r -y $HASHDB" ;;
+		*) return 1 ;;
+	esac
+}
+
+# Pull a top-level number out of the --stats-json output
+stat_value () {
+	sed -n "s/^  \"$1\": \\([0-9.]*\\).*/\\1/p" "$STATS"
+}
+
+# Sum a per-phase field over all phases
+stat_phase_sum () {
+	sed -n "s/.*\"$1\": \\([0-9]*\\).*/\\1/p" "$STATS" | awk '{ s += $1 } END { print s + 0 }'
+}
+
+count_syscalls () {
+	command -v strace >/dev/null 2>&1 || { echo "-"; return; }
+	# shellcheck disable=SC2086
+	strace -f -c -o "$BENCH_DIR.strace" "$JDUPES" -q $1 "$BENCH_DIR" >/dev/null 2>&1
+	awk '$NF == "total" { print $4 }' "$BENCH_DIR.strace"
+	rm -f "$BENCH_DIR.strace"
+}
+
+# Destructive profiles leave the tree modified, so it is rebuilt before
+# the next run (generation time is not part of the results)
+TREE_DIRTY=0
+prepare_run () {
+	test "$TREE_DIRTY" = "1" && gen_tree force
+	TREE_DIRTY=0
+	case "$1" in
+		link) TREE_DIRTY=1 ;;
+		hashdb-cold) rm -f "$HASHDB" "$HASHDB".* ;;
+		hashdb-warm) test -e "$HASHDB" || "$JDUPES" -q -r -y "$HASHDB" "$BENCH_DIR" >/dev/null 2>&1 ;;
+	esac
+}
+
+gen_tree
+printf "profile\trun\tseconds\tuser_seconds\tsystem_seconds\tmax_rss_kib\tstat_calls\topens\treads\tbytes_read\tsyscalls\tstatus\n" > "$BENCH_RESULTS"
+
+for PROFILE in $BENCH_PROFILES
+	do OPTS="$(profile_opts "$PROFILE")" || { echo "error: unknown profile '$PROFILE'" >&2; exit 1; }
+	RUN=1
+	while [ $RUN -le "$BENCH_RUNS" ]
+		do prepare_run "$PROFILE"
+		sync
+		rm -f "$STATS"
+		# shellcheck disable=SC2086
+		"$JDUPES" -q $OPTS $COLD --stats-json="$STATS" "$BENCH_DIR" >/dev/null 2>"$BENCH_DIR.err"
+		STATUS=$?
+		if [ ! -s "$STATS" ]
+			then echo "$PROFILE: skipped ($(head -n 1 "$BENCH_DIR.err"))" >&2
+			break
+		fi
+		SECONDS_WALL="$(stat_value seconds)"
+		CPU="$(sed -n 's/.*"user": \([0-9.]*\), "system": \([0-9.]*\).*/\1	\2/p' "$STATS")"
+		test -z "$CPU" && CPU="-	-"
+		RSS="$(stat_value maxRssKiB)"
+		SYSCALLS="-"
+		if [ $RUN -eq 1 ]
+			then prepare_run "$PROFILE"
+			SYSCALLS="$(count_syscalls "$OPTS $COLD")"
+		fi
+		printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n" "$PROFILE" "$RUN" "$SECONDS_WALL" "$CPU" "${RSS:--}" \
+			"$(sed -n 's/.*"statCalls": \([0-9]*\).*/\1/p' "$STATS")" \
+			"$(stat_phase_sum opens)" "$(stat_phase_sum reads)" "$(stat_phase_sum bytesRead)" \
+			"$SYSCALLS" "$STATUS" >> "$BENCH_RESULTS"
+		echo "$PROFILE run $RUN: ${SECONDS_WALL}s, ${RSS:-?} KiB RSS" >&2
+		RUN=$((RUN + 1))
+	done
+done
+
+# Make sure the next benchmark doesn't start from a modified tree
+test "$TREE_DIRTY" = "1" && rm -f "$STAMP"
+rm -f "$STATS" "$BENCH_DIR.err" "$HASHDB" "$HASHDB".*
+echo "Results written to $BENCH_RESULTS" >&2
@@ -0,0 +1,234 @@
+/* Deterministic file tree generator for benchmarking (make bench)
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* Files that share a prefix only differ after this many bytes, which is
+ * past the partial hash, so only a full read can tell them apart */
+#define SHARED_PREFIX 65536
+
+#define USAGE_TEXT \
+"usage: bench_gentree [options] directory\n\n" \
+"  -n count   number of files (default 10000)\n" \
+"  -m size    minimum file size in bytes (default 0)\n" \
+"  -M size    maximum file size in bytes (default 1048576)\n" \
+"             sizes are spread log-uniformly between the two\n" \
+"  -d pct     percent of files that duplicate an earlier file (default 30)\n" \
+"  -p pct     percent of files that share a %d byte prefix with an\n" \
+"             earlier file but differ after it (default 5)\n" \
+"  -l pct     percent of files that are hard links to an earlier file\n" \
+"             (default 2)\n" \
+"  -D depth   directory depth (default 3)\n" \
+"  -W width   subdirectories per directory (default 4)\n" \
+"  -s seed    random seed (default 1)\n\n" \
+"The same options always produce the same tree.\n"
+
+struct gen_file {
+  uint64_t seed;        /* Content seed */
+  uint64_t tail_seed;   /* Content seed after SHARED_PREFIX (0 = same) */
+  off_t size;
+  char *path;
+};
+
+static uint64_t rng_state;
+
+
+/* xorshift64* */
+static uint64_t rng(uint64_t * const state)
+{
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * UINT64_C(2685821657736338717);
+}
+
+
+static uint64_t rng_below(const uint64_t limit)
+{
+  if (limit == 0) return 0;
+  return rng(&rng_state) % limit;
+}
+
+
+/* Log-uniform size so that small files dominate as in real trees */
+static off_t pick_size(const off_t min, const off_t max)
+{
+  unsigned int bits = 0, minbits = 0;
+  off_t size;
+
+  while (bits < 62 && ((off_t)1 << bits) <= max) bits++;
+  while (minbits < 62 && ((off_t)1 << minbits) <= min) minbits++;
+  if (bits <= minbits) return min;
+  bits = minbits + (unsigned int)rng_below(bits - minbits + 1);
+  size = (bits == 0) ? 0 : (off_t)rng_below((uint64_t)1 << bits);
+  if (size < min) size = min;
+  if (size > max) size = max;
+  return size;
+}
+
+
+static int write_file(const struct gen_file * const restrict f, char * const restrict buf, const size_t bufsize)
+{
+  FILE *fp;
+  uint64_t state = f->seed;
+  off_t done = 0;
+
+  fp = fopen(f->path, "wb");
+  if (fp == NULL) return -1;
+  while (done < f->size) {
+    size_t len = bufsize;
+
+    if ((off_t)len > f->size - done) len = (size_t)(f->size - done);
+    for (size_t i = 0; i < len; i += sizeof(uint64_t)) {
+      uint64_t v;
+
+      if (done + (off_t)i == SHARED_PREFIX && f->tail_seed != 0) state = f->tail_seed;
+      v = rng(&state);
+      memcpy(buf + i, &v, (len - i < sizeof(uint64_t)) ? len - i : sizeof(uint64_t));
+    }
+    if (fwrite(buf, 1, len, fp) != len) {
+      fclose(fp);
+      return -1;
+    }
+    done += (off_t)len;
+  }
+  return fclose(fp);
+}
+
+
+static long long get_number(const char * const restrict arg, const char opt)
+{
+  char *end;
+  long long val = strtoll(arg, &end, 10);
+
+  if (*end != '\0' || val < 0) {
+    fprintf(stderr, "bench_gentree: bad value for -%c: %s\n", opt, arg);
+    exit(EXIT_FAILURE);
+  }
+  return val;
+}
+
+
+int main(int argc, char **argv)
+{
+  struct gen_file *files;
+  char **dirs, *buf;
+  const size_t bufsize = 1048576;
+  unsigned long count = 10000, dircount = 1, leaves = 1, first_leaf = 0;
+  off_t min = 0, max = 1048576;
+  unsigned int dupe_pct = 30, prefix_pct = 5, link_pct = 2, depth = 3, width = 4;
+  uint64_t seed = 1;
+  unsigned long dupes = 0, prefixes = 0, links = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:m:M:d:p:l:D:W:s:h")) != -1) {
+    switch (opt) {
+      case 'n': count = (unsigned long)get_number(optarg, 'n'); break;
+      case 'm': min = (off_t)get_number(optarg, 'm'); break;
+      case 'M': max = (off_t)get_number(optarg, 'M'); break;
+      case 'd': dupe_pct = (unsigned int)get_number(optarg, 'd'); break;
+      case 'p': prefix_pct = (unsigned int)get_number(optarg, 'p'); break;
+      case 'l': link_pct = (unsigned int)get_number(optarg, 'l'); break;
+      case 'D': depth = (unsigned int)get_number(optarg, 'D'); break;
+      case 'W': width = (unsigned int)get_number(optarg, 'W'); break;
+      case 's': seed = (uint64_t)get_number(optarg, 's'); break;
+      case 'h':
+      default:
+        fprintf(stderr, USAGE_TEXT, SHARED_PREFIX);
+        return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+  if (optind != argc - 1 || min > max || dupe_pct + prefix_pct + link_pct > 100 || width == 0 || depth > 16) {
+    fprintf(stderr, USAGE_TEXT, SHARED_PREFIX);
+    return EXIT_FAILURE;
+  }
+  rng_state = seed * UINT64_C(0x9e3779b97f4a7c15) + 1;
+
+  /* Build the directory shape breadth-first; files go in the deepest level */
+  for (unsigned int i = 0; i < depth; i++) {
+    if (leaves > 1000000 / width) {
+      fprintf(stderr, "bench_gentree: -D %u -W %u gives too many directories\n", depth, width);
+      return EXIT_FAILURE;
+    }
+    leaves *= width;
+    dircount += leaves;
+  }
+  first_leaf = dircount - leaves;
+  dirs = (char **)malloc(sizeof(char *) * dircount);
+  files = (struct gen_file *)calloc(count ? count : 1, sizeof(struct gen_file));
+  buf = (char *)malloc(bufsize);
+  if (dirs == NULL || files == NULL || buf == NULL) {
+    fprintf(stderr, "bench_gentree: out of memory\n");
+    return EXIT_FAILURE;
+  }
+  dirs[0] = strdup(argv[optind]);
+  if (mkdir(dirs[0], 0755) != 0 && errno != EEXIST) goto error_mkdir;
+  for (unsigned long i = 1; i < dircount; i++) {
+    const char *parent = dirs[(i - 1) / width];
+    const size_t len = strlen(parent) + 16;
+
+    dirs[i] = (char *)malloc(len);
+    if (dirs[i] == NULL) return EXIT_FAILURE;
+    snprintf(dirs[i], len, "%s/d%lu", parent, (i - 1) % width);
+    if (mkdir(dirs[i], 0755) != 0 && errno != EEXIST) goto error_mkdir;
+  }
+
+  for (unsigned long i = 0; i < count; i++) {
+    struct gen_file * const f = &files[i];
+    const char *dir = dirs[first_leaf + rng_below(leaves)];
+    const size_t len = strlen(dir) + 24;
+    const uint64_t kind = rng_below(100);
+    const struct gen_file * const src = &files[(i > 0) ? rng_below(i) : 0];
+    char * const path = (char *)malloc(len);
+
+    if (path == NULL) return EXIT_FAILURE;
+    snprintf(path, len, "%s/f%lu", dir, i);
+    unlink(path);
+
+    if (i > 0 && kind < link_pct) {
+      /* Hard link to an earlier file */
+      if (link(src->path, path) != 0) goto error_write;
+      *f = *src;
+      f->path = path;
+      links++;
+      continue;
+    }
+    f->path = path;
+    if (i > 0 && kind < link_pct + dupe_pct) {
+      /* Same content as an earlier file */
+      f->seed = src->seed;
+      f->tail_seed = src->tail_seed;
+      f->size = src->size;
+      dupes++;
+    } else if (i > 0 && kind < link_pct + dupe_pct + prefix_pct && src->size > SHARED_PREFIX) {
+      /* Same size and first SHARED_PREFIX bytes as an earlier large file */
+      f->seed = src->seed;
+      f->tail_seed = rng(&rng_state) | 1;
+      f->size = src->size;
+      prefixes++;
+    } else {
+      f->seed = rng(&rng_state) | 1;
+      f->size = pick_size(min, max);
+    }
+    if (write_file(f, buf, bufsize) != 0) goto error_write;
+  }
+
+  printf("%lu files (%lu duplicates, %lu shared prefix, %lu hard links) in %lu directories\n",
+      count, dupes, prefixes, links, dircount);
+  return EXIT_SUCCESS;
+
+error_mkdir:
+  fprintf(stderr, "bench_gentree: can't create directory: %s\n", strerror(errno));
+  return EXIT_FAILURE;
+error_write:
+  fprintf(stderr, "bench_gentree: can't create file: %s\n", strerror(errno));
+  return EXIT_FAILURE;
+}
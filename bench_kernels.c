@@ -0,0 +1,407 @@
+/* Microbenchmarks for the hashing, compare and hash database kernels
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "jdupes.h"
+#include "libjodycode.h"
+#include "likely_unlikely.h"
+#include "filehash.h"
+#include "filestat.h"
+#include "hashdb.h"
+#include "match.h"
+#include "stats.h"
+#ifndef NO_XXHASH2
+ #include "xxhash.h"
+#endif
+
+/* The kernels are linked from the same objects as jdupes, which expect
+ * these to be defined by the main program */
+uint64_t flags = 0, a_flags = 0, p_flags = 0;
+#ifndef NO_CHUNKSIZE
+size_t auto_chunk_size = CHUNK_SIZE;
+#endif
+uintmax_t filecount = 0, progress = 0, item_progress = 0, dupecount = 0;
+unsigned int small_file = 0, partial_hash = 0, partial_elim = 0;
+unsigned int full_hash = 0, partial_to_full = 0, hash_fail = 0;
+uintmax_t comparisons = 0;
+unsigned int user_item_count = 1;
+char tempname[PATHBUF_SIZE * 2];
+int exit_status = EXIT_SUCCESS;
+#ifdef USE_JODY_HASH
+int hash_algo = HASH_ALGO_JODYHASH64;
+#else
+int hash_algo = HASH_ALGO_XXHASH2_64;
+#endif
+
+#define USAGE_TEXT \
+"usage: bench_kernels [options]\n\n" \
+"  -s size    size of each generated input file (default 67108864)\n" \
+"  -c list    comma-separated read sizes for the hash kernels\n" \
+"             (default 4096,16384,65536,262144,1048576)\n" \
+"  -i count   passes per measurement; the fastest one is reported\n" \
+"             (default 5)\n" \
+"  -n count   paths for the path hash and hash database kernels\n" \
+"             (default 200000)\n" \
+"  -d dir     where to create the input files (default .)\n" \
+"  -C         cold cache: drop the input files from the page cache\n" \
+"             before every pass (posix_fadvise DONTNEED)\n\n" \
+"Input files are otherwise read once before timing so that the cached\n" \
+"numbers show the cost of the kernels and not of the disk.\n"
+
+#define MAX_CHUNKS 16
+
+enum kernel_hash {
+  K_READ,  /* No hashing, to show what the reads cost */
+#ifndef NO_XXHASH2
+  K_XXHASH64,
+#endif
+  K_JODYHASH64
+};
+
+static int cold = 0;
+static unsigned int passes = 5;
+/* Results go here so the compiler can't drop the work that made them */
+static volatile uint64_t sink;
+
+
+static int make_input(const char * const restrict name, const off_t size, uint64_t state)
+{
+  const size_t bufsize = 1048576;
+  uint64_t *buf;
+  off_t done = 0;
+  int fd;
+
+  buf = (uint64_t *)malloc(bufsize);
+  if (buf == NULL) jc_oom("make_input()");
+  fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) goto error_write;
+  while (done < size) {
+    size_t len = bufsize;
+
+    if ((off_t)len > size - done) len = (size_t)(size - done);
+    /* xorshift64* so the data is incompressible on any filesystem */
+    for (size_t i = 0; i < bufsize / sizeof(uint64_t); i++) {
+      state ^= state >> 12;
+      state ^= state << 25;
+      state ^= state >> 27;
+      buf[i] = state * UINT64_C(2685821657736338717);
+    }
+    if (write(fd, buf, len) != (ssize_t)len) goto error_write;
+    done += (off_t)len;
+  }
+  /* Dirty pages can't be dropped, so get them onto the disk now */
+  if (fsync(fd) != 0 || close(fd) != 0) goto error_write;
+  free(buf);
+  return 0;
+
+error_write:
+  fprintf(stderr, "bench_kernels: can't create %s: %s\n", name, strerror(errno));
+  if (fd >= 0) close(fd);
+  free(buf);
+  return -1;
+}
+
+
+/* Prepare the input files for a pass: dropped when cold, otherwise loaded */
+static void prepare_input(const char * const restrict name, char * const restrict buf, const size_t bufsize)
+{
+  int fd;
+
+  if (cold) {
+    if (drop_file_cache(name) != 0) {
+      fprintf(stderr, "bench_kernels: can't drop %s from the cache: %s\n", name, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    return;
+  }
+  fd = open(name, O_RDONLY);
+  if (fd < 0) return;
+  while (read(fd, buf, bufsize) > 0) continue;
+  close(fd);
+  return;
+}
+
+
+static void report(const char * const restrict kernel, const size_t chunk, const uintmax_t ops, const uintmax_t bytes, const uint64_t ns)
+{
+  char chunkstr[24] = "-";
+  char gbstr[24] = "-";
+  const char *input = cold ? "cold" : "cached";
+
+  if (chunk != 0) snprintf(chunkstr, sizeof(chunkstr), "%zu", chunk);
+  else input = "memory";
+  if (bytes != 0 && ns != 0) snprintf(gbstr, sizeof(gbstr), "%.3f", (double)bytes / (double)ns);
+  printf("%-14s %8s %-7s %10" PRIuMAX " %12.1f %8s\n", kernel, chunkstr, input, ops,
+      (ops != 0) ? (double)ns / (double)ops : 0.0, gbstr);
+  return;
+}
+
+
+/* Read the input in 'chunk' sized pieces and hash them as get_filehash() does */
+static uint64_t run_hash(const enum kernel_hash kernel, const char * const restrict name,
+    uint64_t * const restrict buf, const size_t chunk, uintmax_t * const restrict ops, uintmax_t * const restrict bytes)
+{
+#ifndef NO_XXHASH2
+  XXH64_state_t *xxhstate;
+#endif
+  uint64_t hash = 0, start, elapsed;
+  ssize_t r;
+  int fd;
+
+  *ops = 0;
+  *bytes = 0;
+  start = stats_now();
+  fd = open(name, O_RDONLY);
+  if (fd < 0) return 0;
+#ifndef NO_XXHASH2
+  xxhstate = XXH64_createState();
+  if (xxhstate == NULL) jc_oom("run_hash()");
+  XXH64_reset(xxhstate, 0);
+#endif
+  while ((r = read(fd, buf, chunk)) > 0) {
+    switch (kernel) {
+#ifndef NO_XXHASH2
+      case K_XXHASH64:
+        XXH64_update(xxhstate, buf, (size_t)r);
+        break;
+#endif
+      case K_JODYHASH64:
+        jc_block_hash(NORMAL, buf, &hash, (size_t)r);
+        break;
+      case K_READ:
+      default:
+        break;
+    }
+    (*ops)++;
+    *bytes += (uintmax_t)r;
+  }
+  close(fd);
+#ifndef NO_XXHASH2
+  if (kernel == K_XXHASH64) hash = XXH64_digest(xxhstate);
+  XXH64_freeState(xxhstate);
+#endif
+  elapsed = stats_now() - start;
+  sink = hash;
+  return elapsed;
+}
+
+
+static void bench_hash(const char * const restrict name, const size_t * const restrict chunks,
+    const unsigned int chunkcnt, char * const restrict prebuf, const size_t prebufsize)
+{
+  static const struct { enum kernel_hash kernel; const char *label; } kernels[] = {
+    { K_READ, "read" },
+#ifndef NO_XXHASH2
+    { K_XXHASH64, "xxhash64" },
+#endif
+    { K_JODYHASH64, "jodyhash64" },
+  };
+  uint64_t *buf;
+
+  for (unsigned int c = 0; c < chunkcnt; c++) {
+    buf = (uint64_t *)aligned_alloc(4096, (chunks[c] + 4095) & ~(size_t)4095);
+    if (buf == NULL) jc_oom("bench_hash()");
+    for (unsigned int k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+      uint64_t best = UINT64_MAX;
+      uintmax_t ops = 0, bytes = 0;
+
+      for (unsigned int i = 0; i < passes; i++) {
+        uint64_t ns;
+
+        prepare_input(name, prebuf, prebufsize);
+        ns = run_hash(kernels[k].kernel, name, buf, chunks[c], &ops, &bytes);
+        if (ns < best) best = ns;
+      }
+      report(kernels[k].label, chunks[c], ops, bytes, best);
+    }
+    free(buf);
+  }
+  return;
+}
+
+
+/* confirmmatch() reads both files in auto_chunk_size pieces */
+static void bench_confirm(const char * const restrict name1, const char * const restrict name2,
+    const off_t size, char * const restrict prebuf, const size_t prebufsize)
+{
+  uint64_t best = UINT64_MAX;
+
+  for (unsigned int i = 0; i < passes; i++) {
+    uint64_t start, ns;
+
+    prepare_input(name1, prebuf, prebufsize);
+    prepare_input(name2, prebuf, prebufsize);
+    start = stats_now();
+    if (confirmmatch(name1, name2, size) != 0) {
+      fprintf(stderr, "bench_kernels: confirmmatch() says the input files differ\n");
+      exit(EXIT_FAILURE);
+    }
+    ns = stats_now() - start;
+    if (ns < best) best = ns;
+  }
+  report("confirmmatch", auto_chunk_size, 1, (uintmax_t)size * 2, best);
+  return;
+}
+
+
+/* Path hashing and the hash database only touch memory */
+static void bench_hashdb(const unsigned long count)
+{
+  file_t *files;
+  char *names;
+  const size_t namelen = 64;
+  uintmax_t bytes = 0;
+  uint64_t start, best, path_hash = 0;
+
+  files = (file_t *)calloc(count, sizeof(file_t));
+  names = (char *)malloc(count * namelen);
+  if (files == NULL || names == NULL) jc_oom("bench_hashdb()");
+  for (unsigned long i = 0; i < count; i++) {
+    char * const name = names + i * namelen;
+
+    bytes += (uintmax_t)snprintf(name, namelen, "/home/user/photos/%04lu/%02lu/IMG_%08lu.jpg", i / 4096, (i / 64) % 64, i);
+    files[i].d_name = name;
+    files[i].size = (off_t)(i * 4099 + 1);
+    files[i].inode = (jdupes_ino_t)(i + 1);
+    files[i].mtime = (time_t)(1600000000 + i);
+    files[i].filehash_partial = (uint64_t)i * UINT64_C(0x9e3779b97f4a7c15);
+    files[i].filehash = ~files[i].filehash_partial;
+    files[i].flags = FF_HASH_PARTIAL | FF_HASH_FULL;
+  }
+
+  best = UINT64_MAX;
+  for (unsigned int p = 0; p < passes; p++) {
+    uint64_t sum = 0;
+
+    start = stats_now();
+    for (unsigned long i = 0; i < count; i++) {
+      get_path_hash(files[i].d_name, &path_hash);
+      sum += path_hash;
+    }
+    start = stats_now() - start;
+    if (start < best) best = start;
+    sink = sum;
+  }
+  report("path_hash", 0, count, bytes, best);
+
+  /* Entries can only be added once, so inserts get a single pass */
+  start = stats_now();
+  for (unsigned long i = 0; i < count; i++) {
+    if (unlikely(add_hashdb_entry(NULL, 0, &files[i]) == NULL)) {
+      fprintf(stderr, "bench_kernels: add_hashdb_entry() failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  report("hashdb_add", 0, count, 0, stats_now() - start);
+
+  best = UINT64_MAX;
+  for (unsigned int p = 0; p < passes; p++) {
+    start = stats_now();
+    for (unsigned long i = 0; i < count; i++) {
+      if (unlikely(read_hashdb_entry(&files[i]) != 1)) {
+        fprintf(stderr, "bench_kernels: read_hashdb_entry() missed an entry\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    start = stats_now() - start;
+    if (start < best) best = start;
+  }
+  report("hashdb_lookup", 0, count, 0, best);
+
+  free(files);
+  free(names);
+  return;
+}
+
+
+static long long get_number(const char * const restrict arg, const char opt)
+{
+  char *end;
+  long long val = strtoll(arg, &end, 10);
+
+  if (*end != '\0' || val <= 0) {
+    fprintf(stderr, "bench_kernels: bad value for -%c: %s\n", opt, arg);
+    exit(EXIT_FAILURE);
+  }
+  return val;
+}
+
+
+int main(int argc, char **argv)
+{
+  size_t chunks[MAX_CHUNKS] = { 4096, 16384, 65536, 262144, 1048576 };
+  unsigned int chunkcnt = 5;
+  off_t size = 67108864;
+  unsigned long count = 200000;
+  const char *dir = ".";
+  char name1[PATHBUF_SIZE], name2[PATHBUF_SIZE];
+  char *prebuf;
+  const size_t prebufsize = 1048576;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:c:i:n:d:Ch")) != -1) {
+    switch (opt) {
+      case 's': size = (off_t)get_number(optarg, 's'); break;
+      case 'i': passes = (unsigned int)get_number(optarg, 'i'); break;
+      case 'n': count = (unsigned long)get_number(optarg, 'n'); break;
+      case 'd': dir = optarg; break;
+      case 'C': cold = 1; break;
+      case 'c':
+        chunkcnt = 0;
+        for (char *tok = strtok(optarg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+          if (chunkcnt == MAX_CHUNKS) {
+            fprintf(stderr, "bench_kernels: too many read sizes (max %d)\n", MAX_CHUNKS);
+            return EXIT_FAILURE;
+          }
+          chunks[chunkcnt++] = (size_t)get_number(tok, 'c');
+        }
+        break;
+      case 'h':
+      default:
+        fprintf(stderr, USAGE_TEXT);
+        return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+  if (optind != argc || chunkcnt == 0) {
+    fprintf(stderr, USAGE_TEXT);
+    return EXIT_FAILURE;
+  }
+#ifndef __linux__
+  if (cold) {
+    fprintf(stderr, "bench_kernels: -C is only supported on Linux\n");
+    return EXIT_FAILURE;
+  }
+#endif
+
+  snprintf(name1, sizeof(name1), "%s/bench_kernels.%ld.1", dir, (long)getpid());
+  snprintf(name2, sizeof(name2), "%s/bench_kernels.%ld.2", dir, (long)getpid());
+  prebuf = (char *)malloc(prebufsize);
+  if (prebuf == NULL) jc_oom("main()");
+  /* Both files have the same content so confirmmatch() reads them fully */
+  if (make_input(name1, size, UINT64_C(0x853c49e6748fea9b)) != 0) goto error_input;
+  if (make_input(name2, size, UINT64_C(0x853c49e6748fea9b)) != 0) goto error_input;
+
+  printf("%-14s %8s %-7s %10s %12s %8s\n", "kernel", "chunk", "input", "ops", "ns/op", "GB/s");
+  bench_hash(name1, chunks, chunkcnt, prebuf, prebufsize);
+  bench_confirm(name1, name2, size, prebuf, prebufsize);
+  bench_hashdb(count);
+
+  unlink(name1);
+  unlink(name2);
+  free(prebuf);
+  return EXIT_SUCCESS;
+
+error_input:
+  unlink(name1);
+  unlink(name2);
+  return EXIT_FAILURE;
+}
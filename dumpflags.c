@@ -29,6 +29,10 @@ void dump_all_flags(void)
   if (ISFLAG(flags, F_NOCHANGECHECK)) fprintf(stderr, " F_NOCHANGECHECK");
   if (ISFLAG(flags, F_NOTRAVCHECK)) fprintf(stderr, " F_NOTRAVCHECK");
   if (ISFLAG(flags, F_SKIPHASH)) fprintf(stderr, " F_SKIPHASH");
+  if (ISFLAG(flags, F_BLOCKHASH)) fprintf(stderr, " F_BLOCKHASH");
+  if (ISFLAG(flags, F_STREAM)) fprintf(stderr, " F_STREAM");
+  if (ISFLAG(flags, F_COLDCACHE)) fprintf(stderr, " F_COLDCACHE");
+  if (ISFLAG(flags, F_AUTOREADSIZE)) fprintf(stderr, " F_AUTOREADSIZE");
   if (ISFLAG(flags, F_BENCHMARKSTOP)) fprintf(stderr, " F_BENCHMARKSTOP");
   if (ISFLAG(flags, F_HASHDB)) fprintf(stderr, " F_HASHDB");
 
@@ -48,6 +52,9 @@ void dump_all_flags(void)
   if (ISFLAG(a_flags, FA_PRINTNULL)) fprintf(stderr, " FA_PRINTNULL");
   if (ISFLAG(a_flags, FA_PRINTJSON)) fprintf(stderr, " FA_PRINTJSON");
   if (ISFLAG(a_flags, FA_ERRORONDUPE)) fprintf(stderr, " FA_ERRORONDUPE");
+  if (ISFLAG(a_flags, FA_DEDUPEBLOCKS)) fprintf(stderr, " FA_DEDUPEBLOCKS");
+  if (ISFLAG(a_flags, FA_PRINTSIMILAR)) fprintf(stderr, " FA_PRINTSIMILAR");
+  if (ISFLAG(a_flags, FA_PRINTNDJSON)) fprintf(stderr, " FA_PRINTNDJSON");
 
   /* Extra print flags */
   if (ISFLAG(p_flags, PF_PARTIAL)) fprintf(stderr, " PF_PARTIAL");
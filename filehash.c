@@ -18,9 +18,13 @@
 
 #include "likely_unlikely.h"
 #include "filehash.h"
+#include "filestat.h"
 #include "interrupt.h"
 #include "progress.h"
 #include "jdupes.h"
+#include "stats.h"
+#include "metrics.h"
+#include "probes.h"
 #include "xxhash.h"
 
 const char *hash_algo_list[2] = {
@@ -28,6 +32,110 @@ const char *hash_algo_list[2] = {
   "jodyhash v7"
 };
 
+#ifndef NO_CHUNKSIZE
+/* -C auto: read requests are sized per device from measured throughput,
+ * while hashing still works through the file in auto_chunk_size pieces.
+ * Each device starts at auto_chunk_size and doubles its read size for as
+ * long as that makes reads at least READ_TUNE_GAIN percent faster. */
+ #ifndef READ_TUNE_MAX
+  #define READ_TUNE_MAX 8388608
+ #endif
+ #ifndef READ_TUNE_SAMPLE
+  #define READ_TUNE_SAMPLE 4194304  /* Minimum bytes timed per read size */
+ #endif
+ #define READ_TUNE_GAIN 10
+ #define READ_TUNE_DEVS 32
+
+struct read_tune {
+  dev_t device;
+  size_t size;       /* Read size in use (or being measured) */
+  size_t best_size;
+  double best_rate;  /* Bytes per nanosecond at best_size */
+  uint64_t bytes;
+  uint64_t ns;
+  int done;
+};
+
+static struct read_tune read_tune[READ_TUNE_DEVS];
+static unsigned int read_tune_cnt = 0;
+static uint64_t *read_buf = NULL;
+
+
+/* Find or add the tuning state for a device; NULL if not tuning reads */
+static struct read_tune *get_read_tune(const dev_t device)
+{
+  struct read_tune *t;
+
+  if (!ISFLAG(flags, F_AUTOREADSIZE)) return NULL;
+  if (unlikely(read_buf == NULL)) {
+    read_buf = (uint64_t *)malloc((auto_chunk_size > READ_TUNE_MAX) ? auto_chunk_size : READ_TUNE_MAX);
+    if (unlikely(read_buf == NULL)) jc_oom("get_read_tune()");
+  }
+  for (unsigned int i = 0; i < read_tune_cnt; i++)
+    if (read_tune[i].device == device) return &read_tune[i];
+  /* Devices past the table limit keep the default read size */
+  if (read_tune_cnt == READ_TUNE_DEVS) return NULL;
+  t = &read_tune[read_tune_cnt++];
+  memset(t, 0, sizeof(struct read_tune));
+  t->device = device;
+  t->size = auto_chunk_size;
+  t->best_size = auto_chunk_size;
+  return t;
+}
+
+
+/* Account one timed read; full-sized reads only, since short reads at the
+ * end of a file say little about what the device can do */
+static void read_tune_sample(struct read_tune * const restrict t, const size_t bytes, const uint64_t ns)
+{
+  double rate;
+
+  if (t == NULL || t->done != 0 || bytes != t->size) return;
+  t->bytes += bytes;
+  t->ns += ns;
+  if (t->bytes < READ_TUNE_SAMPLE || t->bytes < (uint64_t)t->size * 4) return;
+
+  rate = (double)t->bytes / (double)((t->ns != 0) ? t->ns : 1);
+  if (rate * 100 >= t->best_rate * (100 + READ_TUNE_GAIN)) {
+    t->best_rate = rate;
+    t->best_size = t->size;
+    if (t->size <= READ_TUNE_MAX / 2) {
+      t->size *= 2;
+      t->bytes = 0;
+      t->ns = 0;
+      return;
+    }
+  }
+  t->size = t->best_size;
+  t->done = 1;
+  LOUD(fprintf(stderr, "read_tune: device %" PRIuMAX " settled on %zu KiB reads\n", (uintmax_t)t->device, t->size >> 10));
+  return;
+}
+
+
+/* Print the read size chosen for each device (-C auto with --stats) */
+void print_read_sizes(void)
+{
+  for (unsigned int i = 0; i < read_tune_cnt; i++)
+    fprintf(stderr, "  read size:      %zu KiB on device %" PRIuMAX "%s\n", read_tune[i].size >> 10,
+        (uintmax_t)read_tune[i].device, read_tune[i].done ? "" : " (still tuning)");
+  return;
+}
+
+ #define READ_TUNE_START(t) (((t) != NULL && (t)->done == 0) ? stats_now() : 0)
+ #define READ_TUNE_SAMPLE_END(t, len, s) do { if ((s) != 0) read_tune_sample((t), (len), stats_now() - (s)); } while (0)
+ #define READ_SIZE(t) (((t) != NULL) ? (t)->size : auto_chunk_size)
+ #define READ_BUF(t, chunk) (((t) != NULL) ? read_buf : (chunk))
+#else
+struct read_tune;
+ #define get_read_tune(a) NULL
+ #define READ_TUNE_START(t) ((void)(t), (uint64_t)0)
+ #define READ_TUNE_SAMPLE_END(t, len, s) do { (void)(t); (void)(s); } while (0)
+ #define READ_SIZE(t) auto_chunk_size
+ #define READ_BUF(t, chunk) (chunk)
+void print_read_sizes(void) { return; }
+#endif /* NO_CHUNKSIZE */
+
 
 /* Hash part or all of a file
  *
@@ -43,8 +151,14 @@ uint64_t *get_filehash(const file_t * const restrict checkfile, const size_t max
   /* This is an array because we return a pointer to it */
   static uint64_t hash[1];
   static uint64_t *chunk = NULL;
+  uint64_t *readbuf, *slice;
+  struct read_tune *tune;
+  size_t buffered = 0, bufpos = 0;
   FILE *file = NULL;
   int hashing = 0;
+  const int phase = (max_read != 0) ? PHASE_PARTIAL : PHASE_FULL;
+  uint64_t start;
+  off_t length;
 #ifndef NO_XXHASH2
   XXH64_state_t *xxhstate = NULL;
 #endif
@@ -61,6 +175,8 @@ uint64_t *get_filehash(const file_t * const restrict checkfile, const size_t max
     chunk = (uint64_t *)malloc(auto_chunk_size);
     if (unlikely(!chunk)) jc_oom("get_filehash() chunk");
   }
+  tune = get_read_tune(checkfile->device);
+  readbuf = READ_BUF(tune, chunk);
 
   /* Get the file size. If we can't read it, bail out early */
   if (unlikely(checkfile->size == -1)) {
@@ -89,12 +205,16 @@ uint64_t *get_filehash(const file_t * const restrict checkfile, const size_t max
       return hash;
     }
   }
+  start = stats_now();
+  run_stats.opens[phase]++;
   errno = 0;
   file = jc_fopen(checkfile->d_name, JC_FILE_MODE_RDONLY_SEQ);
   if (file == NULL) {
     fprintf(stderr, "\n%s error opening file ", strerror(errno)); jc_fwprint(stderr, checkfile->d_name, 1);
     return NULL;
   }
+  /* --cold-cache: make every hash phase read from the disk */
+  if (ISFLAG(flags, F_COLDCACHE)) drop_fd_cache(fileno(file));
   /* Actually seek past the first chunk if applicable
    * This is part of the filehash_partial skip optimization */
   if (ISFLAG(checkfile->flags, FF_HASH_PARTIAL)) {
@@ -116,6 +236,8 @@ uint64_t *get_filehash(const file_t * const restrict checkfile, const size_t max
     posix_fadvise(filenum, 0, fsize, POSIX_FADV_WILLNEED);
 #endif /* __linux__ */
   }
+  length = fsize;
+  PROBE3(hash_start, checkfile->d_name, checkfile->size - fsize, length);
 
 /* WARNING: READ NOTICE ABOVE get_filehash() BEFORE CHANGING HASH FUNCTIONS! */
 #ifndef NO_XXHASH2
@@ -126,22 +248,34 @@ uint64_t *get_filehash(const file_t * const restrict checkfile, const size_t max
   }
 #endif /* NO_XXHASH2 */
 
-  /* Read the file in chunks until we've read it all. */
+  /* Read the file in chunks until we've read it all. Reads may be larger
+   * than auto_chunk_size (-C auto), but hashing still goes one chunk at a
+   * time so the hash doesn't depend on the read size. */
   while (fsize > 0) {
     size_t bytes_to_read;
 
     if (interrupt) return 0;
-    bytes_to_read = (fsize >= (off_t)auto_chunk_size) ? auto_chunk_size : (size_t)fsize;
-    if (unlikely(fread((void *)chunk, bytes_to_read, 1, file) != 1)) goto error_reading_file;
+    if (bufpos == buffered) {
+      const uint64_t read_start = READ_TUNE_START(tune);
+
+      buffered = (fsize >= (off_t)READ_SIZE(tune)) ? READ_SIZE(tune) : (size_t)fsize;
+      if (unlikely(fread((void *)readbuf, buffered, 1, file) != 1)) goto error_reading_file;
+      READ_TUNE_SAMPLE_END(tune, buffered, read_start);
+      STATS_READ(phase, buffered);
+      bufpos = 0;
+    }
+    bytes_to_read = (buffered - bufpos >= auto_chunk_size) ? auto_chunk_size : buffered - bufpos;
+    slice = (uint64_t *)((uintptr_t)readbuf + bufpos);
+    bufpos += bytes_to_read;
 
   switch (algo) {
 #ifndef NO_XXHASH2
     case HASH_ALGO_XXHASH2_64:
-      if (unlikely(XXH64_update(xxhstate, chunk, bytes_to_read) != XXH_OK)) goto error_reading_file;
+      if (unlikely(XXH64_update(xxhstate, slice, bytes_to_read) != XXH_OK)) goto error_reading_file;
       break;
 #endif
     case HASH_ALGO_JODYHASH64:
-      if (unlikely(jc_block_hash(NORMAL, chunk, hash, bytes_to_read) != 0)) goto error_reading_file;
+      if (unlikely(jc_block_hash(NORMAL, slice, hash, bytes_to_read) != 0)) goto error_reading_file;
       break;
     default:
       goto error_bad_hash_algo;
@@ -151,6 +285,7 @@ uint64_t *get_filehash(const file_t * const restrict checkfile, const size_t max
     else fsize -= (off_t)bytes_to_read;
 
     check_sigusr1();
+    metrics_tick(phase, checkfile->d_name);
     if (jc_alarm_ring != 0) {
       jc_alarm_ring = 0;
       /* Only show "hashing" part if hashing one file updates progress at least twice */
@@ -173,9 +308,12 @@ uint64_t *get_filehash(const file_t * const restrict checkfile, const size_t max
   }
 #endif /* NO_XXHASH2 */
 
+  run_stats.phase_ns[phase] += stats_now() - start;
+  PROBE3(hash_done, checkfile->d_name, length, 0);
   LOUD(fprintf(stderr, "get_filehash: returning hash: 0x%016jx\n", (uintmax_t)*hash));
   return hash;
 error_reading_file:
+  PROBE3(hash_done, checkfile->d_name, length - fsize, -1);
   fprintf(stderr, "\nerror reading from file "); jc_fwprint(stderr, checkfile->d_name, 1);
   fclose(file);
   return NULL;
@@ -187,3 +325,197 @@ error_bad_hash_algo:
   fclose(file);
   return NULL;
 }
+
+
+/* Release a file's block hash vector and any unfinished hash state */
+void free_blockhashes(file_t * const restrict checkfile)
+{
+  if (checkfile->blockhash == NULL) return;
+#ifndef NO_XXHASH2
+  if (checkfile->blockhash->state != NULL) XXH64_freeState((XXH64_state_t *)checkfile->blockhash->state);
+#endif
+  free(checkfile->blockhash);
+  checkfile->blockhash = NULL;
+  return;
+}
+
+
+/* Hash a large file one BLOCKHASH_SIZE block at a time up to block 'want'
+ *
+ * Hashing resumes where the previous call for this file stopped, so a file
+ * is only read as far as comparisons against other files actually need.
+ * The running full file hash is carried along and stored as the file's
+ * full hash once every block is done; it is identical to what
+ * get_filehash() would have produced. The partial hash must already be set.
+ * Returns 0 on success or -1 on failure */
+int get_blockhashes(file_t * const restrict checkfile, uint32_t want, int algo)
+{
+  static uint64_t *chunk = NULL;
+  uint64_t *readbuf, *slice;
+  struct read_tune *tune;
+  size_t buffered = 0, bufpos = 0;
+  blockhash_t *bh;
+  FILE *file;
+  off_t offset, end;
+  uint64_t blockhash, start;
+#ifndef NO_XXHASH2
+  static XXH64_state_t *blockstate = NULL;
+#endif
+
+  if (unlikely(checkfile == NULL || checkfile->d_name == NULL)) jc_nullptr("get_blockhashes()");
+  if (unlikely((algo > HASH_ALGO_COUNT - 1) || (algo < 0))) goto error_bad_hash_algo;
+  if (unlikely(!ISFLAG(checkfile->flags, FF_HASH_PARTIAL) || checkfile->size <= PARTIAL_HASH_SIZE)) return -1;
+  LOUD(fprintf(stderr, "get_blockhashes('%s', %u)\n", checkfile->d_name, want);)
+
+  /* Allocate on first use */
+  if (unlikely(chunk == NULL)) {
+    chunk = (uint64_t *)malloc(auto_chunk_size);
+    if (unlikely(!chunk)) jc_oom("get_blockhashes() chunk");
+  }
+  tune = get_read_tune(checkfile->device);
+  readbuf = READ_BUF(tune, chunk);
+  bh = checkfile->blockhash;
+  if (bh == NULL) {
+    uint32_t count = BLOCKHASH_COUNT(checkfile->size);
+
+    bh = (blockhash_t *)calloc(1, sizeof(blockhash_t) + sizeof(uint64_t) * count);
+    if (unlikely(!bh)) jc_oom("get_blockhashes() vector");
+    bh->hash = (uint64_t *)((uintptr_t)bh + sizeof(blockhash_t));
+    bh->count = count;
+    checkfile->blockhash = bh;
+  }
+  if (want >= bh->count) want = bh->count - 1;
+  if (bh->done > want) return 0;
+
+  /* Start the full file hash the same way get_filehash() does */
+  if (bh->done == 0) {
+    bh->fullhash = checkfile->filehash_partial;
+#ifndef NO_XXHASH2
+    if (algo == HASH_ALGO_XXHASH2_64) {
+      bh->state = XXH64_createState();
+      if (unlikely(bh->state == NULL)) jc_nullptr("xxhstate");
+      XXH64_reset((XXH64_state_t *)bh->state, 0);
+    }
+#endif /* NO_XXHASH2 */
+  }
+#ifndef NO_XXHASH2
+  if (algo == HASH_ALGO_XXHASH2_64 && blockstate == NULL) {
+    blockstate = XXH64_createState();
+    if (unlikely(blockstate == NULL)) jc_nullptr("xxhstate");
+  }
+#endif /* NO_XXHASH2 */
+
+  start = stats_now();
+  run_stats.opens[PHASE_FULL]++;
+  errno = 0;
+  file = jc_fopen(checkfile->d_name, JC_FILE_MODE_RDONLY_SEQ);
+  if (file == NULL) {
+    fprintf(stderr, "\n%s error opening file ", strerror(errno)); jc_fwprint(stderr, checkfile->d_name, 1);
+    return -1;
+  }
+  if (ISFLAG(flags, F_COLDCACHE)) drop_fd_cache(fileno(file));
+  offset = PARTIAL_HASH_SIZE + (off_t)bh->done * BLOCKHASH_SIZE;
+  if (fseeko(file, offset, SEEK_SET) == -1) {
+    fclose(file);
+    fprintf(stderr, "\nerror seeking in file "); jc_fwprint(stderr, checkfile->d_name, 1);
+    return -1;
+  }
+#ifdef __linux__
+  posix_fadvise(fileno(file), offset, (off_t)(want - bh->done + 1) * BLOCKHASH_SIZE, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(fileno(file), offset, (off_t)(want - bh->done + 1) * BLOCKHASH_SIZE, POSIX_FADV_WILLNEED);
+#endif /* __linux__ */
+  /* Reads can span blocks but must not go past the last wanted one */
+  end = PARTIAL_HASH_SIZE + (off_t)(want + 1) * BLOCKHASH_SIZE;
+  if (end > checkfile->size) end = checkfile->size;
+  PROBE3(blocks_start, checkfile->d_name, offset, end - offset);
+
+  while (bh->done <= want) {
+    off_t blockleft = checkfile->size - offset;
+
+    if (blockleft > BLOCKHASH_SIZE) blockleft = BLOCKHASH_SIZE;
+    blockhash = 0;
+#ifndef NO_XXHASH2
+    if (algo == HASH_ALGO_XXHASH2_64) XXH64_reset(blockstate, 0);
+#endif
+    while (blockleft > 0) {
+      size_t bytes_to_read;
+
+      if (interrupt) goto error_interrupted;
+      if (bufpos == buffered) {
+        const uint64_t read_start = READ_TUNE_START(tune);
+
+        buffered = (end - offset >= (off_t)READ_SIZE(tune)) ? READ_SIZE(tune) : (size_t)(end - offset);
+        if (unlikely(fread((void *)readbuf, buffered, 1, file) != 1)) goto error_reading_file;
+        READ_TUNE_SAMPLE_END(tune, buffered, read_start);
+        STATS_READ(PHASE_FULL, buffered);
+        bufpos = 0;
+      }
+      bytes_to_read = (blockleft >= (off_t)auto_chunk_size) ? auto_chunk_size : (size_t)blockleft;
+      if (bytes_to_read > buffered - bufpos) bytes_to_read = buffered - bufpos;
+      slice = (uint64_t *)((uintptr_t)readbuf + bufpos);
+      bufpos += bytes_to_read;
+
+/* WARNING: READ NOTICE ABOVE get_filehash() BEFORE CHANGING HASH FUNCTIONS! */
+      switch (algo) {
+#ifndef NO_XXHASH2
+        case HASH_ALGO_XXHASH2_64:
+          if (unlikely(XXH64_update((XXH64_state_t *)bh->state, slice, bytes_to_read) != XXH_OK)) goto error_reading_file;
+          if (unlikely(XXH64_update(blockstate, slice, bytes_to_read) != XXH_OK)) goto error_reading_file;
+          break;
+#endif
+        case HASH_ALGO_JODYHASH64:
+          if (unlikely(jc_block_hash(NORMAL, slice, &(bh->fullhash), bytes_to_read) != 0)) goto error_reading_file;
+          if (unlikely(jc_block_hash(NORMAL, slice, &blockhash, bytes_to_read) != 0)) goto error_reading_file;
+          break;
+        default:
+          fclose(file);
+          goto error_bad_hash_algo;
+      }
+      blockleft -= (off_t)bytes_to_read;
+      offset += (off_t)bytes_to_read;
+
+      check_sigusr1();
+      metrics_tick(PHASE_FULL, checkfile->d_name);
+      if (jc_alarm_ring != 0) {
+        jc_alarm_ring = 0;
+        update_phase2_progress("hashing", (int)((offset * 100) / checkfile->size));
+      }
+    }
+#ifndef NO_XXHASH2
+    if (algo == HASH_ALGO_XXHASH2_64) blockhash = XXH64_digest(blockstate);
+#endif
+    bh->hash[bh->done] = blockhash;
+    bh->done++;
+  }
+  fclose(file);
+  run_stats.phase_ns[PHASE_FULL] += stats_now() - start;
+  PROBE3(blocks_done, checkfile->d_name, offset, 0);
+
+  /* All blocks are done; the running hash is now the full file hash */
+  if (bh->done == bh->count) {
+#ifndef NO_XXHASH2
+    if (algo == HASH_ALGO_XXHASH2_64) {
+      bh->fullhash = XXH64_digest((XXH64_state_t *)bh->state);
+      XXH64_freeState((XXH64_state_t *)bh->state);
+      bh->state = NULL;
+    }
+#endif /* NO_XXHASH2 */
+    checkfile->filehash = bh->fullhash;
+    SETFLAG(checkfile->flags, FF_HASH_FULL);
+    LOUD(fprintf(stderr, "get_blockhashes: all %u blocks done, full hash: 0x%016jx\n", bh->count, (uintmax_t)bh->fullhash));
+  }
+  return 0;
+
+error_interrupted:
+  PROBE3(blocks_done, checkfile->d_name, offset, -1);
+  fclose(file);
+  return -1;
+error_reading_file:
+  PROBE3(blocks_done, checkfile->d_name, offset, -1);
+  fprintf(stderr, "\nerror reading from file "); jc_fwprint(stderr, checkfile->d_name, 1);
+  fclose(file);
+  return -1;
+error_bad_hash_algo:
+  fprintf(stderr, "\nerror: requested hash algorithm %d is not available", algo);
+  return -1;
+}
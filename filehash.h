@@ -16,6 +16,9 @@ extern const char *hash_algo_list[HASH_ALGO_COUNT];
 #include "jdupes.h"
 
 uint64_t *get_filehash(const file_t * const restrict checkfile, const size_t max_read, int algo);
+int get_blockhashes(file_t * const restrict checkfile, uint32_t want, int algo);
+void free_blockhashes(file_t * const restrict checkfile);
+void print_read_sizes(void);
 
 #ifdef __cplusplus
 }
@@ -20,9 +20,16 @@
    SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
 
 #include <stdio.h>
+#include <errno.h>
+#ifdef __linux__
+ #include <fcntl.h>
+ #include <unistd.h>
+#endif
 #include <libjodycode.h>
 #include "jdupes.h"
 #include "likely_unlikely.h"
+#include "stats.h"
+#include "probes.h"
 
 /* Check file's stat() info to make sure nothing has changed
  * Returns 1 if changed, 0 if not changed, negative if error */
@@ -45,6 +52,7 @@ int file_has_changed(file_t * const restrict file)
   if (file->mode != s.st_mode) return 1;
 #ifndef NO_MTIME
   if (file->mtime != s.st_mtim.tv_sec) return 1;
+  if (file->mtime_nsec != s.st_mtim.tv_nsec) return 1;
 #endif
 #ifndef NO_PERMS
   if (file->uid != s.st_uid) return 1;
@@ -70,12 +78,17 @@ int getfilestats(file_t * const restrict file)
   if (ISFLAG(file->flags, FF_VALID_STAT)) return 0;
   SETFLAG(file->flags, FF_VALID_STAT);
 
-  if (jc_stat(file->d_name, &s) != 0) return -1;
+  PROBE1(stat_start, file->d_name);
+  run_stats.stat_calls++;
+  if (jc_stat(file->d_name, &s) != 0) goto error_stat;
   file->size = s.st_size;
   file->inode = s.st_ino;
   file->device = s.st_dev;
 #ifndef NO_MTIME
   file->mtime = s.st_mtim.tv_sec;
+  file->mtime_nsec = s.st_mtim.tv_nsec;
+  file->ctime = s.st_ctim.tv_sec;
+  file->ctime_nsec = s.st_ctim.tv_nsec;
 #endif
 #ifndef NO_ATIME
   file->atime = s.st_atim.tv_sec;
@@ -89,10 +102,16 @@ int getfilestats(file_t * const restrict file)
   file->gid = s.st_gid;
 #endif
 #ifndef NO_SYMLINKS
-  if (lstat(file->d_name, &s) != 0) return -1;
+  run_stats.stat_calls++;
+  if (lstat(file->d_name, &s) != 0) goto error_stat;
   if (JC_S_ISLNK(s.st_mode) > 0) SETFLAG(file->flags, FF_IS_SYMLINK);
 #endif
+  PROBE2(stat_done, file->d_name, 0);
   return 0;
+
+error_stat:
+  PROBE2(stat_done, file->d_name, -1);
+  return -1;
 }
 
 
@@ -106,6 +125,7 @@ int getdirstats(const char * const restrict name,
   if (unlikely(name == NULL || inode == NULL || dev == NULL)) jc_nullptr("getdirstats");
   LOUD(fprintf(stderr, "getdirstats('%s', %p, %p)\n", name, (void *)inode, (void *)dev);)
 
+  run_stats.stat_calls++;
   if (jc_stat(name, &s) != 0) return -1;
   *inode = s.st_ino;
   *dev = s.st_dev;
@@ -113,3 +133,42 @@ int getdirstats(const char * const restrict name,
   if (!JC_S_ISDIR(s.st_mode)) return 1;
   return 0;
 }
+
+
+/* Drop an open file's pages from the page cache so that the next read of
+ * it has to go to the disk (--cold-cache). Unlike dropping the global cache
+ * this needs no privileges and leaves other files alone; dirty pages stay.
+ * Returns 0 on success or -1 with errno set */
+int drop_fd_cache(const int fd)
+{
+#ifdef __linux__
+  const int err = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+  if (err == 0) return 0;
+  errno = err;
+  return -1;
+#else
+  (void)fd;
+  errno = ENOTSUP;
+  return -1;
+#endif /* __linux__ */
+}
+
+
+/* Same as drop_fd_cache() for a file that isn't open */
+int drop_file_cache(const char * const restrict filename)
+{
+#ifdef __linux__
+  int fd = open(filename, O_RDONLY);
+  int retval;
+
+  if (fd < 0) return -1;
+  retval = drop_fd_cache(fd);
+  close(fd);
+  return retval;
+#else
+  (void)filename;
+  errno = ENOTSUP;
+  return -1;
+#endif /* __linux__ */
+}
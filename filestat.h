@@ -16,6 +16,9 @@ int getfilestats(file_t * const restrict file);
 int getdirstats(const char * const restrict name,
 		jdupes_ino_t * const restrict inode, dev_t * const restrict dev,
 		jdupes_mode_t * const restrict mode);
+/* Return 0 or -1 with errno set */
+int drop_fd_cache(const int fd);
+int drop_file_cache(const char * const restrict filename);
 
 #ifdef __cplusplus
 }
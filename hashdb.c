@@ -2,21 +2,27 @@
  * This file is part of jdupes; see jdupes.c for license information */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <time.h>
+#include <unistd.h>
+#ifndef NO_THREADS
+ #include <pthread.h>
+#endif
 #include "jdupes.h"
 #include "libjodycode.h"
 #include "likely_unlikely.h"
 #include "hashdb.h"
 
-#define HASHDB_VER 2
+#define HASHDB_VER 3
 #define HASHDB_MIN_VER 1
-#define HASHDB_MAX_VER 2
+#define HASHDB_MAX_VER 3
 #ifndef PH_SHIFT
  #define PH_SHIFT 12
 #endif
@@ -27,17 +33,53 @@
 #endif
 #define HT_MASK (HT_SIZE - 1)
 
+/* Longest entry line: the fixed v3 fields (139 chars), a path, '\n' and NUL
+ * Block hash vector lines are streamed and never go through a line buffer */
+#define HASHDB_FIXED_LEN 139
+#define HASHDB_LINE_SIZE (HASHDB_FIXED_LEN + PATHBUF_SIZE + 2)
+
+/* Checkpoint changed entries to the journal after this many changes or secs */
+#ifndef HASHDB_CHECKPOINT_COUNT
+ #define HASHDB_CHECKPOINT_COUNT 4096
+#endif
+#ifndef HASHDB_CHECKPOINT_SECS
+ #define HASHDB_CHECKPOINT_SECS 30
+#endif
+
+/* Thread count limits for dead entry pruning */
+#ifndef PRUNE_MIN_THREADS
+ #define PRUNE_MIN_THREADS 4
+#endif
+#ifndef PRUNE_MAX_THREADS
+ #define PRUNE_MAX_THREADS 64
+#endif
+
 static hashdb_t *hashdb[HT_SIZE];
 static int hashdb_init = 0;
 static int hashdb_algo = 0;
 static int hashdb_dirty = 0;
 static int new_hashdb = 0;
+static uint64_t hashdb_pending = 0;
+/* Entries changed since the last checkpoint, so the journal needn't walk the table */
+static hashdb_t *pending_list = NULL;
+static time_t last_checkpoint = 0;
+
+/* On-disk identity of the database as of our last load or save; if it
+ * differs at save time then another process has written to it since */
+struct hashdb_gen {
+  jdupes_ino_t inode;
+  off_t size;
+  time_t mtime;
+  long mtime_nsec;
+};
+static struct hashdb_gen hashdb_gen;
 
 /* Pivot direction for rebalance */
 enum pivot { PIVOT_LEFT, PIVOT_RIGHT };
 
 static int write_hashdb_entry(FILE *db, hashdb_t *cur, uint64_t *cnt, const int destroy);
-static int get_path_hash(char *path, uint64_t *path_hash);
+static hashdb_t *find_hashdb_entry(char *path, uint64_t *path_hash);
+static int64_t read_hash_database(const char * const restrict dbname, const int merge);
 
 
 #if 0
@@ -55,6 +97,129 @@ void hd16(char *a) {
 #endif
 
 
+/* Mark an entry as changed since the last save and journal checkpoint */
+static inline void mark_hashdb_pending(hashdb_t *cur)
+{
+  hashdb_dirty = 1;
+  if (cur->pending == 0) {
+    cur->pending = 1;
+    cur->next_pending = pending_list;
+    pending_list = cur;
+    hashdb_pending++;
+  }
+  return;
+}
+
+
+static void format_hashdb_header(char *out)
+{
+  struct timeval tm;
+
+  gettimeofday(&tm, NULL);
+  snprintf(out, HASHDB_LINE_SIZE, "jdupes hashdb:%d,%d,%08lx\n", HASHDB_VER, hash_algo, (unsigned long)tm.tv_sec);
+  return;
+}
+
+
+/* Returns -1 if the entry doesn't fit in a line that can be read back */
+static int format_hashdb_entry(char *out, const hashdb_t * const restrict cur)
+{
+  int len;
+
+  len = snprintf(out, HASHDB_LINE_SIZE, "%u,%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%08lx,%016" PRIx64 ",%08lx,%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%s\n",
+    cur->hashcount, cur->partialhash, cur->fullhash, (uint64_t)cur->mtime, (unsigned long)cur->mtime_nsec & 0xffffffffUL,
+    (uint64_t)cur->ctime, (unsigned long)cur->ctime_nsec & 0xffffffffUL,
+    (uint64_t)cur->size, (uint64_t)cur->inode, cur->peer, cur->path);
+  if (len < 0 || len >= HASHDB_LINE_SIZE) return -1;
+  return 0;
+}
+
+
+/* Block hash vectors (-b) follow their entry on a line of their own:
+ * +blocksize,count,hash0hash1hash2... (16 hex digits per block hash) */
+static int write_hashdb_blocks(FILE *db, const hashdb_t * const restrict cur)
+{
+  if (cur->blockhash == NULL || cur->hashcount != 2) return 0;
+  if (db == NULL) db = stdout;
+  errno = 0;
+  fprintf(db, "+%x,%x,", BLOCKHASH_SIZE, cur->blockcount);
+  for (uint32_t i = 0; i < cur->blockcount; i++) fprintf(db, "%016" PRIx64, cur->blockhash[i]);
+  fputc('\n', db);
+  return (errno != 0);
+}
+
+
+/* Read the rest of a block hash vector line into 'entry' if it belongs there
+ * The leading '+' has already been consumed. Returns 0 or -1 if malformed */
+static int read_hashdb_blocks(FILE *db, hashdb_t *entry)
+{
+  char hex[17];
+  unsigned int blocksize, count;
+  uint64_t *vec = NULL;
+  int c;
+
+  if (fscanf(db, "%x,%x,", &blocksize, &count) != 2) return -1;
+  /* Vectors for another block size or a different file size are useless */
+  if (entry != NULL && (blocksize != BLOCKHASH_SIZE || entry->hashcount != 2
+        || entry->size <= PARTIAL_HASH_SIZE || count != BLOCKHASH_COUNT(entry->size))) entry = NULL;
+  if (entry != NULL) {
+    vec = (uint64_t *)malloc(sizeof(uint64_t) * count);
+    if (vec == NULL) jc_oom("read_hashdb_blocks()");
+  }
+  hex[16] = '\0';
+  for (unsigned int i = 0; i < count; i++) {
+    if (fread(hex, 16, 1, db) != 1) goto error_blocks;
+    if (vec != NULL) vec[i] = strtoull(hex, NULL, 16);
+  }
+  c = getc(db);
+  if (c != '\n') goto error_blocks;
+  if (entry != NULL) {
+    free(entry->blockhash);
+    entry->blockhash = vec;
+    entry->blockcount = count;
+  }
+  return 0;
+
+error_blocks:
+  free(vec);
+  return -1;
+}
+
+
+/* Copy a file's completed block hash vector into its database entry
+ * Returns 1 if the entry changed */
+static int attach_blockhashes(hashdb_t * const restrict cur, const file_t * const restrict check)
+{
+  const blockhash_t *bh = check->blockhash;
+
+  if (bh == NULL || bh->done != bh->count || cur->hashcount != 2) return 0;
+  if (cur->blockhash != NULL && cur->blockcount == bh->count
+      && memcmp(cur->blockhash, bh->hash, sizeof(uint64_t) * bh->count) == 0) return 0;
+  free(cur->blockhash);
+  cur->blockhash = (uint64_t *)malloc(sizeof(uint64_t) * bh->count);
+  if (cur->blockhash == NULL) {
+    cur->blockcount = 0;
+    return 0;
+  }
+  memcpy(cur->blockhash, bh->hash, sizeof(uint64_t) * bh->count);
+  cur->blockcount = bh->count;
+  return 1;
+}
+
+
+/* Build the name of a file kept alongside the database, e.g. "db.txt.lock" */
+static char *hashdb_aux_name(const char * const restrict dbname, const char * const restrict suffix)
+{
+  char *name;
+
+  name = malloc(strlen(dbname) + strlen(suffix) + 1);
+  if (name == NULL) return NULL;
+  strcpy(name, dbname);
+  strcat(name, suffix);
+  return name;
+}
+
+
 static hashdb_t *alloc_hashdb_node(const int pathlen)
 {
   int allocsize;
@@ -64,12 +229,206 @@ static hashdb_t *alloc_hashdb_node(const int pathlen)
 }
 
 
+/* Record the on-disk identity of the database (all zero if it is missing) */
+static void get_hashdb_gen(const char * const restrict dbname, struct hashdb_gen *gen)
+{
+  struct JC_STAT s;
+
+  memset(gen, 0, sizeof(struct hashdb_gen));
+  if (jc_stat(dbname, &s) != 0) return;
+  gen->inode = s.st_ino;
+  gen->size = s.st_size;
+  gen->mtime = s.st_mtim.tv_sec;
+  gen->mtime_nsec = s.st_mtim.tv_nsec;
+  return;
+}
+
+
+/* Serialize access between jdupes processes sharing one database
+ * A separate lock file is used because saving replaces the database file
+ * Readers take a shared lock, the writer holds an exclusive lock from the
+ * merge through the final rename. Returns the lock fd or -1 if unlocked */
+static int lock_hashdb(const char * const restrict dbname, const int exclusive)
+{
+#ifndef ON_WINDOWS
+  struct flock fl;
+  char *lockname;
+  int fd;
+
+  lockname = hashdb_aux_name(dbname, ".lock");
+  if (lockname == NULL) return -1;
+  fd = open(lockname, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    LOUD(fprintf(stderr, "lock_hashdb: cannot open '%s': %s\n", lockname, strerror(errno));)
+    free(lockname);
+    return -1;
+  }
+  free(lockname);
+  memset(&fl, 0, sizeof(struct flock));
+  fl.l_type = exclusive ? F_WRLCK : F_RDLCK;
+  fl.l_whence = SEEK_SET;
+  while (fcntl(fd, F_SETLKW, &fl) != 0) {
+    if (errno == EINTR) continue;
+    LOUD(fprintf(stderr, "lock_hashdb: fcntl failed: %s\n", strerror(errno));)
+    close(fd);
+    return -1;
+  }
+  LOUD(fprintf(stderr, "lock_hashdb: took %s lock on '%s'\n", exclusive ? "exclusive" : "shared", dbname);)
+  return fd;
+#else
+  (void)dbname; (void)exclusive;
+  return -1;
+#endif /* ON_WINDOWS */
+}
+
+
+/* Closing the lock file releases the lock */
+static void unlock_hashdb(const int fd)
+{
+#ifndef ON_WINDOWS
+  if (fd >= 0) close(fd);
+#else
+  (void)fd;
+#endif
+  return;
+}
+
+
+/* Pull in changes that other processes saved after we loaded the database
+ * Must be called with the exclusive lock held */
+static void merge_hash_database(const char * const restrict dbname)
+{
+  struct hashdb_gen gen;
+
+  get_hashdb_gen(dbname, &gen);
+  if (gen.inode == hashdb_gen.inode && gen.size == hashdb_gen.size
+      && gen.mtime == hashdb_gen.mtime && gen.mtime_nsec == hashdb_gen.mtime_nsec) return;
+  LOUD(fprintf(stderr, "merge_hash_database: '%s' changed on disk, merging\n", dbname);)
+  if (read_hash_database(dbname, 1) >= 0) new_hashdb = 0;
+  return;
+}
+
+
+/* Replay checkpoints left behind by an interrupted run (ours or another's)
+ * Returns the number of journal entries read */
+static int64_t replay_hashdb_journal(const char * const restrict dbname)
+{
+  char *jname;
+  int64_t cnt;
+
+  jname = hashdb_aux_name(dbname, ".journal");
+  if (jname == NULL) return 0;
+  cnt = read_hash_database(jname, 2);
+  free(jname);
+  if (cnt > 0) hashdb_dirty = 1;
+  return cnt;
+}
+
+
+static int write_hashdb_journal(FILE *db)
+{
+  static char out[HASHDB_LINE_SIZE];
+
+  /* Entries that won't fit are left out; they are simply rehashed */
+  for (hashdb_t *cur = pending_list; cur != NULL; cur = cur->next_pending) {
+    if (format_hashdb_entry(out, cur) != 0) continue;
+    LOUD(fprintf(stderr, "write hashdb journal: %s", out);)
+    errno = 0;
+    fputs(out, db);
+    if (errno != 0) return 1;
+    if (write_hashdb_blocks(db, cur) != 0) return 1;
+  }
+  return 0;
+}
+
+
+/* Empty the pending list once its entries are safely on disk */
+static void clear_hashdb_pending(void)
+{
+  hashdb_t *cur = pending_list;
+
+  while (cur != NULL) {
+    hashdb_t *next = cur->next_pending;
+
+    cur->pending = 0;
+    cur->next_pending = NULL;
+    cur = next;
+  }
+  pending_list = NULL;
+  hashdb_pending = 0;
+  return;
+}
+
+
+/* Append entries changed since the last checkpoint to '<dbname>.journal'
+ * so that an interrupted run doesn't lose the hashes it has computed
+ * Nothing is written until enough changes pile up or enough time passes
+ * unless force = 1. The journal is folded in and removed by the next save */
+int checkpoint_hash_database(const char * const restrict dbname, const int force)
+{
+  static char out[HASHDB_LINE_SIZE];
+  FILE *db = NULL;
+  char *jname = NULL;
+  uint64_t cnt = hashdb_pending;
+  time_t now;
+  int lockfd = -1;
+
+  if (dbname == NULL) goto error_hashdb_null;
+  if (hashdb_pending == 0) return 0;
+  now = time(NULL);
+  if (force == 0 && hashdb_pending < HASHDB_CHECKPOINT_COUNT && now - last_checkpoint < HASHDB_CHECKPOINT_SECS) return 0;
+  last_checkpoint = now;
+  jname = hashdb_aux_name(dbname, ".journal");
+  if (jname == NULL) goto error_hashdb_alloc;
+  lockfd = lock_hashdb(dbname, 1);
+  errno = 0;
+  db = jc_fopen(jname, "ab");
+  if (db == NULL) goto error_hashdb_open;
+  /* New journals get a database header so they can be read like one */
+  fseek(db, 0, SEEK_END);
+  if (ftell(db) == 0) {
+    format_hashdb_header(out);
+    fputs(out, db);
+  }
+  if (write_hashdb_journal(db) != 0) goto error_hashdb_write;
+  if (fflush(db) != 0) goto error_hashdb_write;
+#ifndef ON_WINDOWS
+  fsync(fileno(db));
+#endif
+  fclose(db);
+  unlock_hashdb(lockfd);
+  free(jname);
+  clear_hashdb_pending();
+  LOUD(fprintf(stderr, "checkpoint_hash_database: journaled %" PRIu64 " entries\n", cnt);)
+  return (int)(cnt > INT32_MAX ? INT32_MAX : cnt);
+
+error_hashdb_null:
+  fprintf(stderr, "error: internal failure: NULL pointer for hashdb\n");
+  return -1;
+error_hashdb_alloc:
+  fprintf(stderr, "error: cannot allocate memory for hashdb journal name\n");
+  return -1;
+error_hashdb_open:
+  fprintf(stderr, "warning: cannot open hashdb journal '%s' for writing: %s\n", jname, strerror(errno));
+  unlock_hashdb(lockfd);
+  free(jname);
+  return -1;
+error_hashdb_write:
+  fprintf(stderr, "warning: write failed to hashdb journal '%s': %s\n", jname, strerror(errno));
+  fclose(db);
+  unlock_hashdb(lockfd);
+  free(jname);
+  return -1;
+}
+
+
 /* destroy = 1 will free() all nodes while saving */
 int save_hash_database(const char * const restrict dbname, const int destroy)
 {
   FILE *db = NULL;
   uint64_t cnt = 0;
-  char *dbtemp;
+  char *dbtemp = NULL;
+  int lockfd = -1;
 
   if (dbname == NULL) goto error_hashdb_null;
   LOUD(fprintf(stderr, "save_hash_database('%s') dirty = %d\n", dbname, hashdb_dirty);)
@@ -81,10 +440,16 @@ int save_hash_database(const char * const restrict dbname, const int destroy)
     if (dbtemp == NULL) goto error_hashdb_alloc;
     strcpy(dbtemp, dbname);
     strcat(dbtemp, ".tmp");
+    /* Other processes may have saved since we loaded; fold their work in */
+    lockfd = lock_hashdb(dbname, 1);
+    merge_hash_database(dbname);
+    replay_hashdb_journal(dbname);
     /* Try to remove any existing temporary database, ignoring errors */
     jc_remove(dbtemp);
     db = jc_fopen(dbtemp, JC_FILE_MODE_RW_SEQ);
     if (db == NULL) goto error_hashdb_open;
+    /* Everything pending goes into this save; destroy also frees the entries */
+    clear_hashdb_pending();
     if (write_hashdb_entry(db, NULL, &cnt, destroy) != 0) goto error_hashdb_write;
     fclose(db);
     if (new_hashdb == 0) {
@@ -94,6 +459,14 @@ int save_hash_database(const char * const restrict dbname, const int destroy)
       }
     }
     if (jc_rename(dbtemp, dbname) != 0) goto error_hashdb_rename;
+    get_hashdb_gen(dbname, &hashdb_gen);
+    new_hashdb = 0;
+    /* Everything checkpointed so far is in the database now */
+    free(dbtemp);
+    dbtemp = hashdb_aux_name(dbname, ".journal");
+    if (dbtemp != NULL) jc_remove(dbtemp);
+    unlock_hashdb(lockfd);
+    free(dbtemp);
     LOUD(if (hashdb_dirty == 1) fprintf(stderr, "Wrote %" PRIu64 " items to hash databse '%s'\n", cnt, dbname);)
     hashdb_dirty = 0;
   }
@@ -105,10 +478,14 @@ error_hashdb_null:
   return -1;
 error_hashdb_open:
   fprintf(stderr, "error: cannot open temp hashdb '%s' for writing: %s\n", dbtemp, strerror(errno));
+  unlock_hashdb(lockfd);
+  free(dbtemp);
   return -2;
 error_hashdb_write:
   fprintf(stderr, "error: write failed to temp hashdb '%s': %s\n", dbtemp, strerror(errno));
   fclose(db);
+  unlock_hashdb(lockfd);
+  free(dbtemp);
   return -3;
 error_hashdb_alloc:
   fprintf(stderr, "error: cannot allocate memory for temporary hashdb name\n");
@@ -116,24 +493,26 @@ error_hashdb_alloc:
 error_hashdb_remove:
   fprintf(stderr, "error: cannot delete old hashdb '%s': %s\n", dbname, strerror(errno));
   jc_remove(dbtemp);
+  unlock_hashdb(lockfd);
+  free(dbtemp);
   return -5;
 error_hashdb_rename:
   fprintf(stderr, "error: cannot rename temporary hashdb '%s' to '%s'; leaving it alone: %s\n", dbtemp, dbname, strerror(errno));
+  unlock_hashdb(lockfd);
+  free(dbtemp);
   return -5;
 }
 
 
 static int write_hashdb_entry(FILE *db, hashdb_t *cur, uint64_t *cnt, const int destroy)
 {
-  struct timeval tm;
   int err = 0;
-  static char out[PATHBUF_SIZE + 128];
+  static char out[HASHDB_LINE_SIZE];
 
   LOUD(fprintf(stderr, "write_hashdb_entry(%p, %p, %p, %d)", db, cur, cnt, destroy);)
   /* Write header and traverse array on first call */
   if (unlikely(cur == NULL)) {
-    gettimeofday(&tm, NULL);
-    snprintf(out, PATHBUF_SIZE + 127, "jdupes hashdb:%d,%d,%08lx\n", HASHDB_VER, hash_algo, (unsigned long)tm.tv_sec);
+    format_hashdb_header(out);
     LOUD(fprintf(stderr, "write hashdb: %s", out);)
     errno = 0;
     if (db == NULL) printf("%s", out); else fputs(out, db);
@@ -152,20 +531,22 @@ static int write_hashdb_entry(FILE *db, hashdb_t *cur, uint64_t *cnt, const int
   }
 
   /* Write out this node if it wasn't invalidated */
-  if (cur->hashcount != 0) {
-    snprintf(out, PATHBUF_SIZE + 127, "%u,%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%s\n",
-      cur->hashcount, cur->partialhash, cur->fullhash, (uint64_t)cur->mtime, (uint64_t)cur->size, (uint64_t)cur->inode, cur->path);
+  if (cur->hashcount != 0 && format_hashdb_entry(out, cur) == 0) {
     (*cnt)++;
     LOUD(fprintf(stderr, "write hashdb: %s", out);)
     errno = 0;
     if (db == NULL) printf("%s", out); else fputs(out, db);
     if (errno != 0) return 1;
+    if (write_hashdb_blocks(db, cur) != 0) return 1;
   }
 
   /* Traverse the tree, propagating errors */
   if (err == 0 && cur->left != NULL) err = write_hashdb_entry(db, cur->left, cnt, destroy);
   if (err == 0 && cur->right != NULL) err = write_hashdb_entry(db, cur->right, cnt, destroy);
-  if (destroy == 1) free(cur);
+  if (destroy == 1) {
+    free(cur->blockhash);
+    free(cur);
+  }
   return err;
 }
 
@@ -221,6 +602,31 @@ static void rebalance_hashdb_tree(hashdb_t **parent)
 }
 
 
+/* Check an entry against a file's current stat() info (0 = unchanged)
+ * Entries from v1/v2 databases only have whole-second mtimes; if those
+ * match then the entry is upgraded with the file's full timestamps */
+static int hashdb_entry_changed(hashdb_t * const restrict cur, const file_t * const restrict file)
+{
+  int exclude = 0;
+
+  if (cur->mtime != file->mtime) exclude |= 1;
+  if (cur->inode != file->inode) exclude |= 2;
+  if (cur->size  != file->size)  exclude |= 4;
+  if (cur->mtime_nsec == -1) {
+    if (exclude == 0) {
+      cur->mtime_nsec = file->mtime_nsec;
+      cur->ctime = file->ctime;
+      cur->ctime_nsec = file->ctime_nsec;
+      mark_hashdb_pending(cur);
+    }
+    return exclude;
+  }
+  if (cur->mtime_nsec != file->mtime_nsec) exclude |= 8;
+  if (cur->ctime != file->ctime || cur->ctime_nsec != file->ctime_nsec) exclude |= 16;
+  return exclude;
+}
+
+
 /* in_path allows use of a precomputed path length to avoid extra strlen() calls */
 hashdb_t *add_hashdb_entry(char *in_path, int pathlen, const file_t *check)
 {
@@ -261,21 +667,19 @@ hashdb_t *add_hashdb_entry(char *in_path, int pathlen, const file_t *check)
       if (check != NULL && cur->path != NULL) {
         if (cur->path_hash == path_hash && strcmp(cur->path, check->d_name) == 0) {
           /* Should we invalidate this entry? */
-          exclude = 0;
-          if (cur->mtime != check->mtime) exclude |= 1;
-          if (cur->inode != check->inode) exclude |= 2;
-          if (cur->size  != check->size)  exclude |= 4;
+          exclude = hashdb_entry_changed(cur, check);
           if (exclude == 0) {
             if (cur->hashcount == 1 && ISFLAG(check->flags, FF_HASH_FULL)) {
               cur->hashcount = 2;
               cur->fullhash = check->filehash;
-              hashdb_dirty = 1;
+              mark_hashdb_pending(cur);
             }
+            if (attach_blockhashes(cur, check) != 0) mark_hashdb_pending(cur);
             return cur;
           } else {
             /* Something changed; invalidate this entry */
             cur->hashcount = 0;
-            hashdb_dirty = 1;
+            mark_hashdb_pending(cur);
             return NULL;
           }
         }
@@ -312,7 +716,7 @@ hashdb_t *add_hashdb_entry(char *in_path, int pathlen, const file_t *check)
 
   /* If a check entry was given then populate it */
   if (check != NULL && check->d_name != NULL && ISFLAG(check->flags, FF_HASH_PARTIAL)) {
-    hashdb_dirty = 1;
+    mark_hashdb_pending(file);
     file->path_hash = path_hash;
     file->path = (char *)((uintptr_t)file + (uintptr_t)sizeof(hashdb_t));
     memcpy(file->path, check->d_name, pathlen + 1);
@@ -320,10 +724,15 @@ hashdb_t *add_hashdb_entry(char *in_path, int pathlen, const file_t *check)
     file->size = check->size;
     file->inode = check->inode;
     file->mtime = check->mtime;
+    file->mtime_nsec = check->mtime_nsec;
+    file->ctime = check->ctime;
+    file->ctime_nsec = check->ctime_nsec;
+    file->peer = 0;
     file->partialhash = check->filehash_partial;
     file->fullhash = check->filehash;
     if (ISFLAG(check->flags, FF_HASH_FULL)) file->hashcount = 2;
     else file->hashcount = 1;
+    attach_blockhashes(file, check);
   } else {
     /* No check entry? Populate from passed parameters */
     file->path = (char *)((uintptr_t)file + (uintptr_t)sizeof(hashdb_t));
@@ -334,16 +743,88 @@ hashdb_t *add_hashdb_entry(char *in_path, int pathlen, const file_t *check)
 
 
 /* db header format: jdupes hashdb:dbversion,hashtype,update_mtime
- * db line format: hashcount,partial,full,mtime,size,inode,path */
+ * v1/v2 line format: hashcount,partial,full,mtime,size,inode,path
+ * v3 line format: hashcount,partial,full,mtime,mtime_nsec,ctime,ctime_nsec,size,inode,peer,path */
 int64_t load_hash_database(const char * const restrict dbname)
+{
+  int64_t cnt;
+  int lockfd;
+
+  if (dbname == NULL) return read_hash_database(dbname, 0);
+  lockfd = lock_hashdb(dbname, 0);
+  get_hashdb_gen(dbname, &hashdb_gen);
+  cnt = read_hash_database(dbname, 0);
+  if (cnt >= 0) {
+    int64_t jcnt = replay_hashdb_journal(dbname);
+    if (jcnt > 0 && !ISFLAG(flags, F_HIDEPROGRESS))
+      fprintf(stderr, "Recovered %" PRId64 " checkpointed entries from an interrupted run\n", jcnt);
+  }
+  unlock_hashdb(lockfd);
+  last_checkpoint = time(NULL);
+  return cnt;
+}
+
+
+/* Take an entry read from disk during a merge if it is more current than ours
+ * Entries we invalidated are left alone unless the file changed again since
+ * Returns 1 if a block hash vector following their entry should be taken */
+static int merge_hashdb_entry(hashdb_t *cur, const hashdb_t * const restrict theirs, const int journal)
+{
+  int newer = 0;
+
+  if (theirs->mtime != cur->mtime) newer = (theirs->mtime > cur->mtime);
+  else if (theirs->mtime_nsec != cur->mtime_nsec) newer = (theirs->mtime_nsec > cur->mtime_nsec);
+  else if (theirs->ctime != cur->ctime) newer = (theirs->ctime > cur->ctime);
+  else if (theirs->ctime_nsec != cur->ctime_nsec) newer = (theirs->ctime_nsec > cur->ctime_nsec);
+  else if (cur->hashcount != 0 && theirs->inode == cur->inode && theirs->size == cur->size
+      && theirs->partialhash == cur->partialhash) {
+    /* Same file version: keep whatever extra work the other process did */
+    if (theirs->hashcount == 0) {
+      /* Only journals record invalidated entries */
+      cur->hashcount = 0;
+      return 0;
+    }
+    if (journal == 1 && theirs->peer != 0 && theirs->hashcount == 2) cur->peer = theirs->peer;
+    if (cur->hashcount == 1 && theirs->hashcount == 2) {
+      cur->fullhash = theirs->fullhash;
+      cur->hashcount = 2;
+    }
+    if (cur->peer == 0 && cur->hashcount == 2 && theirs->hashcount == 2
+        && cur->fullhash == theirs->fullhash) cur->peer = theirs->peer;
+    return (cur->blockhash == NULL && cur->hashcount == 2 && theirs->hashcount == 2
+        && cur->fullhash == theirs->fullhash);
+  }
+  if (newer == 0) return 0;
+  LOUD(fprintf(stderr, "merge_hashdb_entry: taking newer entry for '%s'\n", cur->path);)
+  cur->mtime = theirs->mtime;
+  cur->mtime_nsec = theirs->mtime_nsec;
+  cur->ctime = theirs->ctime;
+  cur->ctime_nsec = theirs->ctime_nsec;
+  cur->peer = theirs->peer;
+  cur->inode = theirs->inode;
+  cur->size = theirs->size;
+  cur->partialhash = theirs->partialhash;
+  cur->fullhash = theirs->fullhash;
+  cur->hashcount = theirs->hashcount;
+  free(cur->blockhash);
+  cur->blockhash = NULL;
+  cur->blockcount = 0;
+  return 1;
+}
+
+
+/* merge = 1 folds the on-disk database into the one in memory
+ * merge = 2 does the same for a journal, which may hold invalidations */
+static int64_t read_hash_database(const char * const restrict dbname, const int merge)
 {
   FILE *db;
-  char line[PATHBUF_SIZE + 128];
-  char buf[PATHBUF_SIZE + 128];
+  char line[HASHDB_LINE_SIZE];
+  char buf[HASHDB_LINE_SIZE];
   char *field, *temp;
   int db_ver;
   unsigned int fixed_len;
-  int64_t linenum = 1;
+  int64_t linenum = 1, blocklines = 0;
+  hashdb_t *last = NULL;
 #ifdef LOUD_DEBUG
   time_t db_mtime;
   char date[32];
@@ -356,10 +837,11 @@ int64_t load_hash_database(const char * const restrict dbname)
   if (db == NULL) goto warn_hashdb_open;
 
   /* Read header line */
-  if ((fgets(buf, PATHBUF_SIZE + 127, db) == NULL) || (ferror(db) != 0)) {
+  if ((fgets(buf, HASHDB_LINE_SIZE, db) == NULL) || (ferror(db) != 0)) {
     if (errno == 0) goto warn_hashdb_open;  // empty file = make new DB
     goto error_hashdb_read;
-  } else if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "Loading hash database...");
+  } else if (strchr(buf, '\n') == NULL) goto error_hashdb_header;
+  else if (merge == 0 && !ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "Loading hash database...");
   field = strtok(buf, ":");
   if (strcmp(field, "jdupes hashdb") != 0) goto error_hashdb_header;
   field = strtok(NULL, ":");
@@ -375,8 +857,9 @@ int64_t load_hash_database(const char * const restrict dbname)
   if (db_ver < HASHDB_MIN_VER || db_ver > HASHDB_MAX_VER) goto error_hashdb_version;
   if (hashdb_algo != hash_algo) goto warn_hashdb_algo;
 
-  /* v1 has 8-byte sizes; v2 has 16-byte (4GiB+) sizes */
-  fixed_len = 87;
+  /* v1 has 8-byte sizes; v2 has 16-byte (4GiB+) sizes; v3 adds ns/ctime/peer */
+  fixed_len = HASHDB_FIXED_LEN;
+  if (db_ver == 2) fixed_len = 87;
   if (db_ver == 1) fixed_len = 71;
 
   /* Read database entries */
@@ -384,21 +867,39 @@ int64_t load_hash_database(const char * const restrict dbname)
     int pathlen;
     unsigned int linelen;
     int hashcount;
-    uint64_t partialhash, fullhash = 0;
-    time_t mtime;
+    uint64_t partialhash, fullhash = 0, peer = 0;
+    time_t mtime, ctime = 0;
+    long mtime_nsec = -1, ctime_nsec = 0;
     char *path;
     hashdb_t *entry;
     off_t size;
     jdupes_ino_t inode;
+    int c;
 
     errno = 0;
-    if ((fgets(line, PATHBUF_SIZE + 128, db) == NULL)) {
+    /* A '+' line holds the block hash vector for the entry before it */
+    c = getc(db);
+    if (c == '+') {
+      linenum++;
+      blocklines++;
+      if (read_hashdb_blocks(db, last) != 0) {
+        strcpy(line, "(malformed block hash vector)");
+        goto error_hashdb_line;
+      }
+      last = NULL;
+      continue;
+    }
+    if (c != EOF) ungetc(c, db);
+    last = NULL;
+    if ((fgets(line, HASHDB_LINE_SIZE, db) == NULL)) {
       if (ferror(db) != 0) goto error_hashdb_read;
       break;
     }
     LOUD(fprintf(stderr, "read hashdb: %s", line);)
-    strncpy(buf, line, PATHBUF_SIZE + 128);
     linenum++;
+    /* Reject over-long lines instead of reading the rest as another entry */
+    if (strchr(line, '\n') == NULL && feof(db) == 0) goto error_hashdb_line;
+    strncpy(buf, line, HASHDB_LINE_SIZE);
     linelen = (int64_t)strlen(buf);
     if (linelen < fixed_len + 1) goto error_hashdb_line;
 
@@ -406,44 +907,84 @@ int64_t load_hash_database(const char * const restrict dbname)
      * hashcount: 1 = partial only, 2 = partial and full */
     field = strtok(buf, ","); if (field == NULL) goto error_hashdb_line;
     hashcount = (int)strtol(field, NULL, 16);
-    if (hashcount < 1 || hashcount > 2) goto error_hashdb_line;
+    if (hashcount < (merge == 2 ? 0 : 1) || hashcount > 2) goto error_hashdb_line;
     field = strtok(NULL, ","); if (field == NULL) goto error_hashdb_line;
     partialhash = strtoull(field, NULL, 16);
     field = strtok(NULL, ","); if (field == NULL) goto error_hashdb_line;
     if (hashcount == 2) fullhash = strtoull(field, NULL, 16);
     field = strtok(NULL, ","); if (field == NULL) goto error_hashdb_line;
-    mtime = (time_t)strtoul(field, NULL, 16);
+    mtime = (time_t)strtoull(field, NULL, 16);
+    if (db_ver >= 3) {
+      field = strtok(NULL, ","); if (field == NULL) goto error_hashdb_line;
+      mtime_nsec = strtol(field, NULL, 16);
+      field = strtok(NULL, ","); if (field == NULL) goto error_hashdb_line;
+      ctime = (time_t)strtoull(field, NULL, 16);
+      field = strtok(NULL, ","); if (field == NULL) goto error_hashdb_line;
+      ctime_nsec = strtol(field, NULL, 16);
+    }
     field = strtok(NULL, ","); if (field == NULL) goto error_hashdb_line;
     size = strtoll(field, NULL, 16);
     if (size == 0) goto error_hashdb_line;
     field = strtok(NULL, ","); if (field == NULL) goto error_hashdb_line;
     inode = strtoull(field, NULL, 16);
+    if (db_ver >= 3) {
+      field = strtok(NULL, ","); if (field == NULL) goto error_hashdb_line;
+      peer = strtoull(field, NULL, 16);
+    }
 
     path = buf + fixed_len;
     path = strtok(path, "\n"); if (path == NULL) goto error_hashdb_line;
-    pathlen = linelen - fixed_len + 1;
+    pathlen = (int)strlen(path);
     if (pathlen > PATHBUF_SIZE) goto error_hashdb_line;
-    *(path + pathlen) = '\0';
+
+    if (merge != 0) {
+      hashdb_t theirs;
+      uint64_t path_hash;
+
+      if (get_path_hash(path, &path_hash) != 0) goto error_hashdb_line;
+      entry = find_hashdb_entry(path, &path_hash);
+      if (entry != NULL) {
+        theirs.mtime = mtime;
+        theirs.mtime_nsec = mtime_nsec;
+        theirs.ctime = ctime;
+        theirs.ctime_nsec = ctime_nsec;
+        theirs.peer = peer;
+        theirs.inode = inode;
+        theirs.size = size;
+        theirs.partialhash = partialhash;
+        theirs.fullhash = fullhash;
+        theirs.hashcount = hashcount;
+        if (merge_hashdb_entry(entry, &theirs, merge == 2) != 0) last = entry;
+        continue;
+      }
+      if (hashcount == 0) continue;
+    }
 
     /* Allocate and populate a tree entry */
     entry = add_hashdb_entry(path, pathlen, NULL);
     if (entry == NULL) goto error_hashdb_add;
     memcpy(entry->path, path, pathlen + 1);
     entry->mtime = mtime;
+    entry->mtime_nsec = mtime_nsec;
+    entry->ctime = ctime;
+    entry->ctime_nsec = ctime_nsec;
+    entry->peer = peer;
     entry->inode = inode;
     entry->size = size;
     entry->partialhash = partialhash;
     entry->fullhash = fullhash;
     entry->hashcount = hashcount;
+    last = entry;
   }
 
   fclose(db);
-  return linenum - 1;
+  return linenum - 1 - blocklines;
 
 warn_hashdb_open:
+  if (db != NULL) fclose(db);
+  if (merge != 0) return 0;
   fprintf(stderr, "Creating a new hash database '%s'\n", dbname);
   new_hashdb = 1;
-  fclose(db);
   return 0;
 error_hashdb_read:
   fprintf(stderr, "error reading hash database '%s': %s\n", dbname, strerror(errno));
@@ -469,13 +1010,13 @@ error_hashdb_null:
   fprintf(stderr, "error: internal failure: NULL pointer for hashdb\n");
   return -6;
 warn_hashdb_algo:
-  fprintf(stderr, "warning: hashdb uses a different hash algorithm than selected; not loading\n");
+  fprintf(stderr, "warning: hashdb uses a different hash algorithm than selected; not %s\n", merge ? "merging" : "loading");
   fclose(db);
   return -7;
 }
 
 
-static int get_path_hash(char *path, uint64_t *path_hash)
+int get_path_hash(char *path, uint64_t *path_hash)
 {
   uint64_t aligned_path[(PATHBUF_SIZE + 8) / sizeof(uint64_t)];
   int retval;
@@ -489,53 +1030,63 @@ static int get_path_hash(char *path, uint64_t *path_hash)
 }
 
 
+/* Find the tree entry for a path; returns NULL if there is none */
+static hashdb_t *find_hashdb_entry(char *path, uint64_t *path_hash)
+{
+  hashdb_t *cur;
+
+  cur = hashdb[*path_hash & HT_MASK];
+  while (cur != NULL) {
+    if (cur->path_hash != *path_hash) {
+      if (*path_hash < cur->path_hash) cur = cur->left;
+      else cur = cur->right;
+      continue;
+    }
+    /* Found a matching path hash */
+    if (strcmp(cur->path, path) == 0) return cur;
+    cur = cur->left;
+  }
+  return NULL;
+}
+
+
 /* Scan database for a matching file entry; if found, load hashes into it */
 int read_hashdb_entry(file_t *file)
 {
-  unsigned int bucket;
   hashdb_t *cur;
   uint64_t path_hash;
-  int exclude;
 
   LOUD(fprintf(stderr, "read_hashdb_entry('%s')\n", file->d_name);)
   if (file == NULL || file->d_name == NULL) goto error_null;
   if (get_path_hash(file->d_name, &path_hash) != 0) goto error_path_hash;
-  bucket = path_hash & HT_MASK;
-  if (hashdb[bucket] == NULL) return 0;
-  cur = hashdb[bucket];
-  while (1) {
-    if (cur->path_hash != path_hash) {
-      if (path_hash < cur->path_hash) cur = cur->left;
-      else cur = cur->right;
-      if (cur == NULL) return 0;
-      continue;
-    }
-    /* Found a matching path hash */
-    if (strcmp(cur->path, file->d_name) != 0) {
-      cur = cur->left;
-      if (cur == NULL) return 0;
-      continue;
-    } else {
-      /* Found a matching path too but check mtime */
-      exclude = 0;
-      if (cur->mtime != file->mtime) exclude |= 1;
-      if (cur->inode != file->inode) exclude |= 2;
-      if (cur->size  != file->size)  exclude |= 4;
-      if (exclude != 0) {
-        /* Invalidate if something has changed */
-        cur->hashcount = 0;
-        hashdb_dirty = 1;
-        return -1;
-      }
-      file->filehash_partial = cur->partialhash;
-      if (cur->hashcount == 2) {
-        file->filehash = cur->fullhash;
-        SETFLAG(file->flags, (FF_HASH_PARTIAL | FF_HASH_FULL));
-      } else SETFLAG(file->flags, FF_HASH_PARTIAL);
-      return 1;
-    }
+  cur = find_hashdb_entry(file->d_name, &path_hash);
+  if (cur == NULL || cur->hashcount == 0) return 0;
+
+  /* Found a matching path too but check mtime */
+  if (hashdb_entry_changed(cur, file) != 0) {
+    /* Invalidate if something has changed */
+    cur->hashcount = 0;
+    mark_hashdb_pending(cur);
+    return -1;
   }
-  return 0;
+  file->filehash_partial = cur->partialhash;
+  if (cur->hashcount == 2) {
+    file->filehash = cur->fullhash;
+    SETFLAG(file->flags, (FF_HASH_PARTIAL | FF_HASH_FULL));
+    /* Block hash vectors are only loaded when they will be used */
+    if (ISFLAG(flags, F_BLOCKHASH) && cur->blockhash != NULL && file->blockhash == NULL
+        && file->size > PARTIAL_HASH_SIZE && cur->blockcount == BLOCKHASH_COUNT(file->size)) {
+      blockhash_t *bh = (blockhash_t *)calloc(1, sizeof(blockhash_t) + sizeof(uint64_t) * cur->blockcount);
+      if (bh == NULL) jc_oom("read_hashdb_entry()");
+      bh->hash = (uint64_t *)((uintptr_t)bh + sizeof(blockhash_t));
+      bh->count = cur->blockcount;
+      bh->done = cur->blockcount;
+      bh->fullhash = cur->fullhash;
+      memcpy(bh->hash, cur->blockhash, sizeof(uint64_t) * cur->blockcount);
+      file->blockhash = bh;
+    }
+  } else SETFLAG(file->flags, FF_HASH_PARTIAL);
+  return 1;
 
 error_null:
   fprintf(stderr, "error: internal error: NULL data passed to read_hashdb_entry()\n");
@@ -546,54 +1097,251 @@ error_path_hash:
 }
 
 
-int cleanup_hashdb(uint64_t *cnt, hashdb_t *cur)
+/* Returns 1 if a previous run byte-for-byte confirmed these two files against
+ * each other and neither one has changed since (including change time) */
+int hashdb_pair_confirmed(const file_t * const restrict file1, const file_t * const restrict file2)
 {
-  int err = 0;
-  static char **list;
-  static uint64_t listsize;
-  char *temp;
-  unsigned int i;
+  hashdb_t *e1, *e2;
+  uint64_t h1, h2;
+
+  if (unlikely(file1 == NULL || file2 == NULL)) jc_nullptr("hashdb_pair_confirmed()");
+  if (get_path_hash(file1->d_name, &h1) != 0 || get_path_hash(file2->d_name, &h2) != 0) return 0;
+  e1 = find_hashdb_entry(file1->d_name, &h1);
+  e2 = find_hashdb_entry(file2->d_name, &h2);
+  if (e1 == NULL || e2 == NULL) return 0;
+  if (e1->hashcount != 2 || e2->hashcount != 2) return 0;
+  if (e1->peer != h2 && e2->peer != h1) return 0;
+  if (e1->mtime_nsec == -1 || e2->mtime_nsec == -1) return 0;
+  if (hashdb_entry_changed(e1, file1) != 0 || hashdb_entry_changed(e2, file2) != 0) return 0;
+  if (e1->fullhash != e2->fullhash || e1->fullhash != file1->filehash || e2->fullhash != file2->filehash) return 0;
+  LOUD(fprintf(stderr, "hashdb_pair_confirmed: '%s' and '%s' were confirmed previously\n", file1->d_name, file2->d_name);)
+  return 1;
+}
 
-  /* First call: traverse array, sort results, do actual verification */
-  if (unlikely(cur == NULL)) {
-    list = NULL;
-    listsize = 0;
-    *cnt = 0;
 
-    for (i = 0; i < HT_SIZE; i++) {
-      if (hashdb[i] == NULL) continue;
-      err = cleanup_hashdb(cnt, hashdb[i]);
-      if (err != 0) return err;
-    }
+/* Record that two files were byte-for-byte confirmed as identical */
+void hashdb_confirm_pair(const file_t * const restrict file1, const file_t * const restrict file2)
+{
+  hashdb_t *e1, *e2;
+  uint64_t h1, h2;
+
+  if (unlikely(file1 == NULL || file2 == NULL)) jc_nullptr("hashdb_confirm_pair()");
+  if (get_path_hash(file1->d_name, &h1) != 0 || get_path_hash(file2->d_name, &h2) != 0) return;
+  e1 = find_hashdb_entry(file1->d_name, &h1);
+  e2 = find_hashdb_entry(file2->d_name, &h2);
+  if (e1 == NULL || e2 == NULL || e1->hashcount != 2 || e2->hashcount != 2) return;
+  /* file1 was just matched; it records the file it was confirmed against */
+  if (e1->peer != h2) {
+    e1->peer = h2;
+    mark_hashdb_pending(e1);
+  }
+  /* file2 heads the set and is confirmed against many files; keep its first peer */
+  if (e2->peer == 0) {
+    e2->peer = h1;
+    mark_hashdb_pending(e2);
+  }
+  return;
+}
 
-    /* TODO: sort list first */
 
-    /* Check each item for existence; remove if it can't be accessed */
-    for (i = 0; i < *cnt; i++) {
-      char *path = *(list + i);
-      if (jc_access(path, JC_F_OK) == 0) continue;
-      /* TODO: invalidate entry - maybe need pointer? */
+/* Split a path into directory and base name lengths for prune sorting */
+static size_t prune_dirlen(const char * const restrict path)
+{
+  const char *slash = strrchr(path, '/');
+#ifdef ON_WINDOWS
+  const char *bslash = strrchr(path, '\\');
+  if (bslash > slash) slash = bslash;
+#endif
+  if (slash == NULL) return 0;
+  return (size_t)(slash - path);
+}
+
+
+/* Sort by directory first so each directory is only opened once */
+static int prune_sort(const void *a, const void *b)
+{
+  const hashdb_t *e1 = *(const hashdb_t * const *)a;
+  const hashdb_t *e2 = *(const hashdb_t * const *)b;
+  const size_t d1 = prune_dirlen(e1->path);
+  const size_t d2 = prune_dirlen(e2->path);
+  int cmp;
+
+  cmp = strncmp(e1->path, e2->path, d1 < d2 ? d1 : d2);
+  if (cmp != 0) return cmp;
+  if (d1 != d2) return (d1 < d2) ? -1 : 1;
+  return strcmp(e1->path + d1, e2->path + d2);
+}
+
+
+/* Returns nonzero if the on-disk file no longer matches the entry */
+static int prune_entry_is_dead(const hashdb_t * const restrict cur, const struct JC_STAT * const restrict s)
+{
+  if (!JC_S_ISREG(s->st_mode)) return 1;
+  if (cur->mtime != s->st_mtim.tv_sec) return 1;
+  if (cur->inode != s->st_ino) return 1;
+  if (cur->size  != s->st_size) return 1;
+  return 0;
+}
+
+
+/* Gather every valid entry in the tree into the prune list */
+static void prune_collect(hashdb_t *cur, hashdb_t ***list, uint64_t *cnt, uint64_t *listsize)
+{
+  while (cur != NULL) {
+    if (cur->hashcount != 0) {
+      if (*listsize == *cnt) {
+        *listsize += 65536;
+        *list = (hashdb_t **)realloc(*list, sizeof(hashdb_t *) * *listsize);
+        if (*list == NULL) jc_oom("cleanup_hashdb list");
+      }
+      (*list)[*cnt] = cur;
+      (*cnt)++;
     }
+    if (cur->left != NULL) prune_collect(cur->left, list, cnt, listsize);
+    cur = cur->right;
+  }
+  return;
+}
 
-    return 0;
+
+#ifndef NO_THREADS
+/* Work shared between prune threads; each thread claims one directory at a time */
+struct prune_work {
+  hashdb_t **list;
+  uint64_t cnt;
+  uint64_t next;
+  uint64_t removed;
+  pthread_mutex_t lock;
+};
+
+
+static void *prune_thread(void *arg)
+{
+  struct prune_work * const work = (struct prune_work *)arg;
+  char dirbuf[PATHBUF_SIZE + 1];
+  struct JC_STAT s;
+  uint64_t removed = 0;
+
+  while (1) {
+    uint64_t first, last;
+    size_t dirlen;
+    int dirfd;
+
+    /* Claim the next run of entries that share a directory */
+    pthread_mutex_lock(&work->lock);
+    first = work->next;
+    if (first >= work->cnt) {
+      pthread_mutex_unlock(&work->lock);
+      break;
+    }
+    dirlen = prune_dirlen(work->list[first]->path);
+    last = first + 1;
+    while (last < work->cnt && prune_dirlen(work->list[last]->path) == dirlen
+        && strncmp(work->list[first]->path, work->list[last]->path, dirlen) == 0) last++;
+    work->next = last;
+    pthread_mutex_unlock(&work->lock);
+
+    /* Open the parent directory once and stat each name relative to it */
+    dirfd = -1;
+    if (dirlen > 0 && dirlen <= PATHBUF_SIZE) {
+      memcpy(dirbuf, work->list[first]->path, dirlen);
+      dirbuf[dirlen] = '\0';
+      dirfd = open(dirbuf, O_RDONLY | O_DIRECTORY);
+    } else if (dirlen == 0) dirfd = AT_FDCWD;
+
+    for (uint64_t i = first; i < last; i++) {
+      hashdb_t *cur = work->list[i];
+      const char *name = (dirlen == 0) ? cur->path : cur->path + dirlen + 1;
+      int dead;
+
+      if (dirfd == -1) dead = (jc_stat(cur->path, &s) != 0) || prune_entry_is_dead(cur, &s);
+      else dead = (fstatat(dirfd, name, &s, 0) != 0) || prune_entry_is_dead(cur, &s);
+      if (dead) {
+        LOUD(fprintf(stderr, "cleanup_hashdb: pruning '%s'\n", cur->path);)
+        cur->hashcount = 0;
+        removed++;
+      }
+    }
+    if (dirfd >= 0) close(dirfd);
   }
 
-  /* If node is valid, add file to list to be checked, expanding array as needed */
-  if (cur->hashcount != 0) {
-    if (listsize == *cnt) {
-      listsize += 4096;
-      list = realloc(list, sizeof(char *) * listsize);
-      if (list == NULL) jc_oom("cleanup_hashdb realloc");
+  pthread_mutex_lock(&work->lock);
+  work->removed += removed;
+  pthread_mutex_unlock(&work->lock);
+  return NULL;
+}
+#endif /* NO_THREADS */
+
+
+/* Remove entries for files that are missing or have changed since hashing
+ * Entries are sorted by directory and checked by a pool of threads so that
+ * stat() latency on slow or network filesystems overlaps. Invalidated entries
+ * are dropped the next time the database is saved.
+ * Returns 0 on success with the number of entries checked and removed */
+int cleanup_hashdb(uint64_t *cnt, uint64_t *removed)
+{
+  hashdb_t **list = NULL;
+  uint64_t listsize = 0;
+#ifndef NO_THREADS
+  struct prune_work work;
+  pthread_t *threads;
+  long nthreads;
+  int started = 0;
+#else
+  struct JC_STAT s;
+#endif
+
+  if (unlikely(cnt == NULL || removed == NULL)) jc_nullptr("cleanup_hashdb()");
+  *cnt = 0;
+  *removed = 0;
+  if (hashdb_init == 0) return 0;
+
+  for (int i = 0; i < HT_SIZE; i++)
+    if (hashdb[i] != NULL) prune_collect(hashdb[i], &list, cnt, &listsize);
+  if (*cnt == 0) return 0;
+
+  qsort(list, *cnt, sizeof(hashdb_t *), prune_sort);
+
+#ifndef NO_THREADS
+  /* stat() is latency-bound, so use more threads than CPUs */
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN) * 4;
+  if (nthreads < PRUNE_MIN_THREADS) nthreads = PRUNE_MIN_THREADS;
+  if (nthreads > PRUNE_MAX_THREADS) nthreads = PRUNE_MAX_THREADS;
+  if ((uint64_t)nthreads > *cnt) nthreads = (long)*cnt;
+  LOUD(fprintf(stderr, "cleanup_hashdb: checking %" PRIu64 " entries with %ld threads\n", *cnt, nthreads);)
+
+  work.list = list;
+  work.cnt = *cnt;
+  work.next = 0;
+  work.removed = 0;
+  if (pthread_mutex_init(&work.lock, NULL) != 0) goto error_thread;
+  threads = (pthread_t *)malloc(sizeof(pthread_t) * (size_t)nthreads);
+  if (threads == NULL) jc_oom("cleanup_hashdb threads");
+  for (; started < nthreads; started++)
+    if (pthread_create(&threads[started], NULL, prune_thread, &work) != 0) break;
+  /* If no threads could be started, do the work on this one */
+  if (started == 0) prune_thread(&work);
+  for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+  pthread_mutex_destroy(&work.lock);
+  free(threads);
+  *removed = work.removed;
+#else
+  for (uint64_t i = 0; i < *cnt; i++) {
+    if (jc_stat(list[i]->path, &s) != 0 || prune_entry_is_dead(list[i], &s)) {
+      list[i]->hashcount = 0;
+      (*removed)++;
     }
-    temp = (char *)malloc(strlen(cur->path) + 1);
-    if (temp == NULL) jc_oom("cleanup_hashdb path");
-    *(list + *cnt) = temp;
-    strcpy(temp, cur->path);
-    (void)*cnt++;
   }
+#endif /* NO_THREADS */
 
-  /* Traverse the tree, propagating errors */
-  if (err == 0 && cur->left != NULL) err = cleanup_hashdb(cnt, cur->left);
-  if (err == 0 && cur->right != NULL) err = cleanup_hashdb(cnt, cur->right);
-  return err;
+  if (*removed > 0) hashdb_dirty = 1;
+  free(list);
+  return 0;
+
+#ifndef NO_THREADS
+error_thread:
+  fprintf(stderr, "error: cannot initialize hashdb cleanup threads\n");
+  free(list);
+  return -1;
+#endif
 }
@@ -21,15 +21,27 @@ typedef struct _hashdb {
   jdupes_ino_t inode;
   off_t size;
   time_t mtime;
+  long mtime_nsec;  /* -1 for v1/v2 entries without sub-second times */
+  time_t ctime;
+  long ctime_nsec;
+  uint64_t peer;  /* path hash of a file this one was byte-confirmed against */
+  uint64_t *blockhash;  /* per-block hashes for -b, NULL if none */
+  uint32_t blockcount;
   uint_fast8_t hashcount;
+  struct _hashdb *next_pending;  /* next entry to journal, see pending */
+  uint_fast8_t pending;  /* changed since the last journal checkpoint */
 } hashdb_t;
 
 extern int save_hash_database(const char * const restrict dbname, const int destroy);
+extern int checkpoint_hash_database(const char * const restrict dbname, const int force);
 extern hashdb_t *add_hashdb_entry(char *in_path, const int in_pathlen, const file_t *check);
 extern int64_t load_hash_database(const char * const restrict dbname);
 extern int read_hashdb_entry(file_t *file);
+extern int get_path_hash(char *path, uint64_t *path_hash);
 extern uint64_t dump_hashdb(void);
-extern int cleanup_hashdb(uint64_t *cnt, hashdb_t *cur);
+extern int cleanup_hashdb(uint64_t *cnt, uint64_t *removed);
+extern int hashdb_pair_confirmed(const file_t * const restrict file1, const file_t * const restrict file2);
+extern void hashdb_confirm_pair(const file_t * const restrict file1, const file_t * const restrict file2);
 
 #ifdef __cplusplus
 }
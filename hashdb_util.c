@@ -27,7 +27,8 @@ int main(int argc, char **argv)
   const char * const default_name = "jdupes_hashdb.txt";
   const char *dbname, *action;
   int64_t hdbsize;
-  uint64_t cnt;
+  uint64_t cnt, removed;
+  int written;
 
   if (argc != 3) goto util_usage;
 
@@ -61,7 +62,11 @@ int main(int argc, char **argv)
     return 0;
   } else if (strcmp(action, "clean") == 0) {
     fprintf(stderr, "Cleaning entries\n");
-    if (cleanup_hashdb(&cnt, NULL) != 0) goto error_hashdb_cleanup;
+    if (cleanup_hashdb(&cnt, &removed) != 0) goto error_hashdb_cleanup;
+    fprintf(stderr, "Checked %" PRIu64 " entries, removing %" PRIu64 " dead entries\n", cnt, removed);
+    written = save_hash_database(dbname, 1);
+    if (written < 0) goto error_hashdb_cleanup;
+    if (removed > 0) fprintf(stderr, "Wrote %d entries to the hash database\n", written);
   } else goto error_action;
 
   return 0;
@@ -70,7 +75,10 @@ util_usage:
   printf("jdupes hashdb utility %s (%s)\n", VER, VERDATE);
   printf("usage: %s hash_database_name action\n", argv[0]);
   printf("If the name is a period '.' then 'jdupes_hashdb.txt' will be used\n");
-  printf("Actions: none yet\n");
+  printf("Actions: dump   print all entries in the database to stdout\n");
+  printf("         clean  remove entries for missing or modified files\n");
+  printf("Paths are checked relative to the current directory, so run this from the\n");
+  printf("same directory that jdupes was run from when the database was created.\n");
   exit(EXIT_FAILURE);
 error_hashdb_cleanup:
   fprintf(stderr, "error cleaning up hash database '%s'\n", dbname);
@@ -53,6 +53,9 @@ const char *feature_flags[] = {
   #ifdef NO_JSON
   "nojson",
   #endif
+  #ifdef NO_METRICS
+  "nometrics",
+  #endif
   #ifdef NO_GETOPT_LONG
   "nolongopt",
   #endif
@@ -62,9 +65,18 @@ const char *feature_flags[] = {
   #ifdef NO_PERMS
   "noperm",
   #endif
+  #ifdef NO_SIMILAR
+  "nosimilar",
+  #endif
   #ifdef NO_SYMLINKS
   "noslink",
   #endif
+  #ifdef NO_STREAM
+  "nostream",
+  #endif
+  #ifdef NO_THREADS
+  "nothreads",
+  #endif
   #ifdef NO_TRAVCHECK
   "notrav",
   #endif
@@ -77,6 +89,9 @@ const char *feature_flags[] = {
   #ifdef UNICODE
   "unicode",
   #endif
+  #ifdef USE_USDT
+  "usdt",
+  #endif
   #ifdef ON_WINDOWS
   "windows",
   #endif
@@ -101,11 +116,19 @@ void help_text(void)
   printf(" -0 --print-null  \toutput nulls instead of CR/LF (like 'find -print0')\n");
   printf(" -1 --one-file-system\tdo not match files on different filesystems/devices\n");
   printf(" -A --no-hidden    \texclude hidden files from consideration\n");
+  printf(" -b --block-hashes\thash large files in blocks and stop reading them at\n");
+  printf("                  \tthe first block that differs; with -y the block\n");
+  printf("                  \thashes are kept in the hash database\n");
 #ifdef ENABLE_DEDUPE
   printf(" -B --dedupe      \tdo a copy-on-write (reflink/clone) deduplication\n");
 #endif
+#ifndef NO_SIMILAR
+  printf(" -c --similar=%%   \tlist pairs of files that share at least %% percent of\n");
+  printf("                  \tthe smaller file's content, even if sizes differ\n");
+#endif /* NO_SIMILAR */
 #ifndef NO_CHUNKSIZE
   printf(" -C --chunk-size=#\toverride I/O chunk size in KiB (min %d, max %d)\n", MIN_CHUNK_SIZE / 1024, MAX_CHUNK_SIZE / 1024);
+  printf("                  \t'-C auto' sizes hashing reads per device by throughput\n");
 #endif /* NO_CHUNKSIZE */
 #ifndef NO_DELETE
   printf(" -d --delete      \tprompt user for files to preserve and delete all\n");
@@ -122,6 +145,15 @@ void help_text(void)
   printf(" -e --error-on-dupe\texit on any duplicate found with status code 255\n");
 #endif
   printf(" -f --omit-first  \tomit the first file in each set of matches\n");
+#ifndef NO_STREAM
+  printf(" -F --stream      \tact on each set as soon as no more files of its size\n");
+  printf("                  \tremain, freeing memory as it goes; sets are handled\n");
+  printf("                  \tin order of size (print, delete, link, dedupe only)\n");
+#endif /* NO_STREAM */
+#if defined ENABLE_DEDUPE && defined __linux__
+  printf(" -G --dedupe-blocks\twith --dedupe, also dedupe identical blocks shared by\n");
+  printf("                  \tsame-size files that are not full duplicates\n");
+#endif
   printf(" -h --help        \tdisplay this help message\n");
 #ifndef NO_HARDLINKS
   printf(" -H --hard-links  \ttreat any linked files as duplicate files. Normally\n");
@@ -133,6 +165,8 @@ void help_text(void)
 #endif
 #ifndef NO_JSON
   printf(" -j --json        \tproduce JSON (machine-readable) output\n");
+  printf(" -J --ndjson      \tprint one JSON object per match set and line, written\n");
+  printf("                  \tas each set is finished (implies --stream)\n");
 #endif /* NO_JSON */
 /*  printf(" -K --skip-hash   \tskip full file hashing (may be faster; 100%% safe)\n");
     printf("                  \tWARNING: in development, not fully working yet!\n"); */
@@ -184,6 +218,10 @@ void help_text(void)
   printf(" -U --no-trav-check\tdisable double-traversal safety check (BE VERY CAREFUL)\n");
   printf("                  \tThis fixes a Google Drive File Stream recursion issue\n");
   printf(" -v --version     \tdisplay jdupes version and license information\n");
+#ifndef NO_THREADS
+  printf(" -W --workers=#   \trun up to # actions in parallel (--dedupe, and --delete\n");
+  printf("                  \twith --no-prompt); 0 uses one worker per CPU\n");
+#endif /* NO_THREADS */
 #ifndef NO_EXTFILTER
   printf(" -X --ext-filter=x:y\tfilter files based on specified criteria\n");
   printf("                  \tUse '-X help' for detailed extfilter help\n");
@@ -195,6 +233,20 @@ void help_text(void)
 #ifndef ON_WINDOWS
   printf("                  \tYou can send SIGUSR1 to the program to toggle this\n");
 #endif
+#ifndef NO_GETOPT_LONG
+  printf("    --stats       \tprint time, bytes read and throughput for each phase\n");
+  printf("                  \t(scan, partial hash, full hash, confirm, action)\n");
+  printf("    --stats-json=file\twrite run statistics (file counts, bytes read, stage\n");
+  printf("                  \teliminations, phase timings) to a JSON file at exit\n");
+  printf("    --cold-cache  \tdrop each file from the page cache before reading it\n");
+  printf("                  \tso benchmarks measure disk reads (Linux only)\n");
+ #ifndef NO_METRICS
+  printf("    --metrics=path[:secs]\twrite a JSON progress record every secs seconds\n");
+  printf("                  \t(default 1) to a FIFO or Unix domain socket\n");
+ #endif
+  printf("    --funnel      \tprint how many files each step ruled out and a\n");
+  printf("                  \thistogram of size group sizes at exit\n");
+#endif
 
 #else /* NO_HELPTEXT */
   version_text(0);
@@ -42,6 +42,8 @@
 #include "progress.h"
 #include "interrupt.h"
 #include "sort.h"
+#include "stats.h"
+#include "metrics.h"
 #ifndef NO_TRAVCHECK
  #include "travcheck.h"
 #endif
@@ -58,6 +60,7 @@
 
 /* Headers for post-scanning actions */
 #include "act_deletefiles.h"
+#include "act_funnel.h"
 #ifdef ENABLE_DEDUPE
  #include "act_dedupefiles.h"
 #endif
@@ -66,6 +69,9 @@
 #ifndef NO_JSON
  #include "act_printjson.h"
 #endif /* NO_JSON */
+#ifndef NO_SIMILAR
+ #include "act_printsimilar.h"
+#endif /* NO_SIMILAR */
 #include "act_summarize.h"
 
 
@@ -96,14 +102,24 @@ static const char *program_name;
  #define auto_chunk_size CHUNK_SIZE
 #endif /* NO_CHUNKSIZE */
 
+/* Long options that have no short option letter */
+#define OPT_STATS_JSON 0x100
+#define OPT_STATS      0x101
+#define OPT_COLD_CACHE 0x102
+#define OPT_METRICS    0x103
+#define OPT_FUNNEL     0x104
+
+/* Print a candidate funnel report at exit (--funnel) */
+static int funnel_report = 0;
+
 /* Required for progress indicator code */
 uintmax_t filecount = 0, progress = 0, item_progress = 0, dupecount = 0;
 
-/* Performance and behavioral statistics (debug mode) */
-#ifdef DEBUG
+/* Performance and behavioral statistics (see also stats.c) */
 unsigned int small_file = 0, partial_hash = 0, partial_elim = 0;
 unsigned int full_hash = 0, partial_to_full = 0, hash_fail = 0;
 uintmax_t comparisons = 0;
+#ifdef DEBUG
  #ifdef ON_WINDOWS
   #ifndef NO_HARDLINKS
   unsigned int hll_exclude = 0;
@@ -134,6 +150,9 @@ char tempname[PATHBUF_SIZE * 2];
 const char *s_interrupt = "\nStopping file scan due to user abort\n";
 const char *s_no_dupes = "No duplicates found.\n";
 
+/* Number of worker threads for actions that can run in parallel */
+unsigned int worker_count = 1;
+
 /* Exit status; use exit() codes for setting this */
 int exit_status = EXIT_SUCCESS;
 
@@ -142,6 +161,102 @@ int exit_status = EXIT_SUCCESS;
 /***** Add new functions here *****/
 
 
+/* Run the requested actions on a file list */
+static void run_actions(file_t *files, int argc, char **argv)
+{
+  const uint64_t start = stats_now();
+
+  metrics_tick(PHASE_ACTION, NULL);
+#ifdef NO_JSON
+  (void)argc;
+  (void)argv;
+#endif
+#ifndef NO_DELETE
+  if (ISFLAG(a_flags, FA_DELETEFILES)) {
+    if (ISFLAG(flags, F_NOPROMPT)) deletefiles(files, 0, 0);
+    else deletefiles(files, 1, stdin);
+  }
+#endif /* NO_DELETE */
+#ifndef NO_SYMLINKS
+  if (ISFLAG(a_flags, FA_MAKESYMLINKS)) linkfiles(files, 0, 0);
+#endif /* NO_SYMLINKS */
+#ifndef NO_HARDLINKS
+  if (ISFLAG(a_flags, FA_HARDLINKFILES)) linkfiles(files, 1, 0);
+#endif /* NO_HARDLINKS */
+#ifdef ENABLE_DEDUPE
+  if (ISFLAG(a_flags, FA_DEDUPEFILES)) dedupefiles(files);
+#endif /* ENABLE_DEDUPE */
+  if (ISFLAG(a_flags, FA_PRINTMATCHES)) printmatches(files);
+  if (ISFLAG(a_flags, FA_PRINTUNIQUE)) printunique(files);
+#ifndef NO_JSON
+  if (ISFLAG(a_flags, FA_PRINTJSON)) printjson(files, argc, argv);
+  if (ISFLAG(a_flags, FA_PRINTNDJSON)) printndjson(files);
+#endif /* NO_JSON */
+#ifndef NO_SIMILAR
+  if (ISFLAG(a_flags, FA_PRINTSIMILAR)) printsimilar(files);
+#endif /* NO_SIMILAR */
+  if (ISFLAG(a_flags, FA_SUMMARIZEMATCHES)) {
+    if (ISFLAG(a_flags, FA_PRINTMATCHES)) printf("\n\n");
+    summarizematches(files);
+  }
+  run_stats.phase_ns[PHASE_ACTION] += stats_now() - start;
+  return;
+}
+
+
+#ifndef NO_STREAM
+/* Streaming (-F): the file list is sorted by size, so a size group can't
+ * gain any more duplicates once the next size begins. Each finished group
+ * is acted on right away and its memory is released. */
+static file_t stream_sentinel;
+static int stream_sets = 0;
+
+static void free_filetree(filetree_t *tree)
+{
+  while (tree != NULL) {
+    filetree_t * const right = tree->right;
+
+    free_filetree(tree->left);
+    free(tree);
+    tree = right;
+  }
+  return;
+}
+
+
+static void stream_group(file_t * const group, file_t * const last, const int final, int argc, char **argv)
+{
+  file_t *cur, *next;
+  int found = 0;
+
+  for (cur = group; cur != NULL; cur = cur->next) {
+    if (ISFLAG(cur->flags, FF_HAS_DUPES)) found = 1;
+    if (cur == last) break;
+  }
+  if (found != 0) {
+    /* Actions treat the group as a whole file list; the sentinel keeps the
+     * set separators the same as in a list that continues on */
+    last->next = final ? NULL : &stream_sentinel;
+    run_actions(group, argc, argv);
+    stream_sets = 1;
+  }
+
+  if (funnel_report != 0) funnel_add(group, last);
+
+  free_filetree(checktree);
+  checktree = NULL;
+  for (cur = group; ; cur = next) {
+    next = cur->next;
+    free_blockhashes(cur);
+    free(cur->d_name);
+    free(cur);
+    if (cur == last) break;
+  }
+  return;
+}
+#endif /* NO_STREAM */
+
+
 #ifdef UNICODE
 int wmain(int argc, wchar_t **wargv)
 #else
@@ -150,11 +265,17 @@ int main(int argc, char **argv)
 {
   static file_t *files = NULL;
   static file_t *curfile;
+  uint64_t stats_start;
+#ifndef NO_STREAM
+  static file_t *stream_start = NULL, *stream_last = NULL;
+#endif
   static char **oldargv;
   static int firstrecurse;
   static int opt;
   static int pm = 1;
   static int partialonly_spec = 0;
+  static const char *stats_json_name = NULL;
+  static int stats_summary = 0;
 #ifndef NO_MTIME  /* Remove if new order types are added! */
   static ordertype_t ordertype = ORDER_NAME;
 #endif
@@ -184,18 +305,23 @@ int main(int argc, char **argv)
     { "one-file-system", 0, 0, '1' },
     { "", 0, 0, '9' },
     { "no-hidden", 0, 0, 'A' },
+    { "block-hashes", 0, 0, 'b' },
     { "dedupe", 0, 0, 'B' },
+    { "similar", 1, 0, 'c' },
     { "chunk-size", 1, 0, 'C' },
     { "debug", 0, 0, 'D' },
     { "delete", 0, 0, 'd' },
     { "error-on-dupe", 0, 0, 'e' },
     { "ext-option", 0, 0, 'E' },
     { "omit-first", 0, 0, 'f' },
+    { "stream", 0, 0, 'F' },
+    { "dedupe-blocks", 0, 0, 'G' },
     { "hard-links", 0, 0, 'H' },
     { "help", 0, 0, 'h' },
     { "isolate", 0, 0, 'I' },
     { "reverse", 0, 0, 'i' },
     { "json", 0, 0, 'j' },
+    { "ndjson", 0, 0, 'J' },
 /*    { "skip-hash", 0, 0, 'K' }, */
     { "link-hard", 0, 0, 'L' },
     { "link-soft", 0, 0, 'l' },
@@ -217,10 +343,16 @@ int main(int argc, char **argv)
     { "no-trav-check", 0, 0, 'U' },
     { "print-unique", 0, 0, 'u' },
     { "version", 0, 0, 'v' },
+    { "workers", 1, 0, 'W' },
     { "ext-filter", 1, 0, 'X' },
     { "hash-db", 1, 0, 'y' },
     { "soft-abort", 0, 0, 'Z' },
     { "zero-match", 0, 0, 'z' },
+    { "stats", 0, 0, OPT_STATS },
+    { "stats-json", 1, 0, OPT_STATS_JSON },
+    { "cold-cache", 0, 0, OPT_COLD_CACHE },
+    { "metrics", 1, 0, OPT_METRICS },
+    { "funnel", 0, 0, OPT_FUNNEL },
     { NULL, 0, 0, 0 }
   };
  #define GETOPT getopt_long
@@ -228,7 +360,9 @@ int main(int argc, char **argv)
  #define GETOPT getopt
 #endif
 
-#define GETOPT_STRING "@019ABC:DdEefHhIijKLlMmNnOo:P:pQqRrSsTtUuVvX:y:Zz"
+#define GETOPT_STRING "@019AbBc:C:DdEefFGHhIijJKLlMmNnOo:P:pQqRrSsTtUuVvW:X:y:Zz"
+
+  run_stats.start_ns = stats_now();
 
   /* Verify libjodycode compatibility before going further */
   if (libjodycode_version_check(1, 0) != 0) {
@@ -305,6 +439,10 @@ int main(int argc, char **argv)
     case 'A':
       SETFLAG(flags, F_EXCLUDEHIDDEN);
       break;
+    case 'b':
+      SETFLAG(flags, F_BLOCKHASH);
+      LOUD(fprintf(stderr, "opt: per-block hash vectors for large files (--block-hashes)\n");)
+      break;
 #ifdef ENABLE_DEDUPE
     case 'B':
 #ifdef __linux__
@@ -326,9 +464,31 @@ int main(int argc, char **argv)
       CLEARFLAG(flags, F_INCLUDEEMPTY);
       LOUD(fprintf(stderr, "opt: CoW/block-level deduplication enabled (--dedupe)\n");)
       break;
+#ifdef __linux__
+    case 'G':
+      SETFLAG(a_flags, FA_DEDUPEBLOCKS);
+      LOUD(fprintf(stderr, "opt: partial-file block-level deduplication enabled (--dedupe-blocks)\n");)
+      break;
+#endif /* __linux__ */
 #endif /* ENABLE_DEDUPE */
+#ifndef NO_SIMILAR
+    case 'c':
+      similar_percent = (unsigned int)strtoul(optarg, NULL, 10);
+      if (similar_percent < 1 || similar_percent > 100) {
+        fprintf(stderr, "invalid value for --similar: '%s' (must be 1-100)\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      SETFLAG(a_flags, FA_PRINTSIMILAR);
+      LOUD(fprintf(stderr, "opt: print files sharing %u%% of content (--similar)\n", similar_percent);)
+      break;
+#endif /* NO_SIMILAR */
 #ifndef NO_CHUNKSIZE
     case 'C':
+      if (strcmp(optarg, "auto") == 0) {
+        SETFLAG(flags, F_AUTOREADSIZE);
+        LOUD(fprintf(stderr, "opt: tune read size per device from throughput (-C auto)\n");)
+        break;
+      }
       manual_chunk_size = (strtol(optarg, NULL, 10) & 0x0ffffffcL) << 10;  /* Align to 4K sizes */
       if (manual_chunk_size < MIN_CHUNK_SIZE || manual_chunk_size > MAX_CHUNK_SIZE) {
         fprintf(stderr, "warning: invalid manual chunk size (must be %d - %d KiB); using defaults\n", MIN_CHUNK_SIZE / 1024, MAX_CHUNK_SIZE / 1024);
@@ -403,6 +563,14 @@ int main(int argc, char **argv)
       SETFLAG(a_flags, FA_PRINTJSON);
       LOUD(fprintf(stderr, "opt: print output in JSON format (--print-json)\n");)
       break;
+    case 'J':
+      SETFLAG(a_flags, FA_PRINTNDJSON);
+#ifndef NO_STREAM
+      /* Sets are written out as soon as they are finished */
+      SETFLAG(flags, F_STREAM);
+#endif
+      LOUD(fprintf(stderr, "opt: print one JSON line per match set (--ndjson)\n");)
+      break;
 #endif /* NO_JSON */
     case 'K':
       SETFLAG(flags, F_SKIPHASH);
@@ -502,6 +670,25 @@ int main(int argc, char **argv)
       SETFLAG(a_flags, FA_SHOWSIZE);
       LOUD(fprintf(stderr, "opt: show size of files enabled (--size)\n");)
       break;
+#ifndef NO_STREAM
+    case 'F':
+      SETFLAG(flags, F_STREAM);
+      LOUD(fprintf(stderr, "opt: act on each size group as soon as it is finished (--stream)\n");)
+      break;
+#endif /* NO_STREAM */
+    case 'W':
+      worker_count = (unsigned int)strtoul(optarg, NULL, 10);
+#ifndef NO_THREADS
+      if (worker_count == 0) {
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        worker_count = (cpus > 0) ? (unsigned int)cpus : 1;
+      }
+#else
+      worker_count = 1;
+#endif /* NO_THREADS */
+      if (worker_count > MAX_WORKERS) worker_count = MAX_WORKERS;
+      LOUD(fprintf(stderr, "opt: %u worker threads (--workers)\n", worker_count);)
+      break;
 #ifndef NO_EXTFILTER
     case 'X':
       add_extfilter(optarg);
@@ -532,6 +719,34 @@ int main(int argc, char **argv)
       SETFLAG(flags, F_SOFTABORT);
       LOUD(fprintf(stderr, "opt: soft-abort mode enabled (--soft-abort)\n");)
       break;
+    case OPT_STATS:
+      stats_summary = 1;
+      LOUD(fprintf(stderr, "opt: print per-phase statistics at exit (--stats)\n");)
+      break;
+    case OPT_STATS_JSON:
+      stats_json_name = optarg;
+      LOUD(fprintf(stderr, "opt: write run statistics to '%s' (--stats-json)\n", optarg);)
+      break;
+    case OPT_COLD_CACHE:
+#ifdef __linux__
+      SETFLAG(flags, F_COLDCACHE);
+      LOUD(fprintf(stderr, "opt: drop each file from the page cache before reading (--cold-cache)\n");)
+#else
+      fprintf(stderr, "warning: --cold-cache is only supported on Linux; ignoring\n");
+#endif
+      break;
+    case OPT_METRICS:
+#ifndef NO_METRICS
+      if (metrics_open(optarg) != 0) exit(EXIT_FAILURE);
+      LOUD(fprintf(stderr, "opt: write metrics records to '%s' (--metrics)\n", optarg);)
+#else
+      fprintf(stderr, "warning: --metrics is not supported in this build; ignoring\n");
+#endif
+      break;
+    case OPT_FUNNEL:
+      funnel_report = 1;
+      LOUD(fprintf(stderr, "opt: print a candidate funnel report at exit (--funnel)\n");)
+      break;
     case '@':
 #ifdef LOUD_DEBUG
       SETFLAG(flags, F_DEBUG | F_LOUD | F_HIDEPROGRESS);
@@ -588,6 +803,13 @@ skip_partialonly_noise:
     exit(EXIT_FAILURE);
   }
 
+#ifdef ENABLE_DEDUPE
+  if (ISFLAG(a_flags, FA_DEDUPEBLOCKS) && !ISFLAG(a_flags, FA_DEDUPEFILES)) {
+    fprintf(stderr, "option --dedupe-blocks requires --dedupe\n");
+    exit(EXIT_FAILURE);
+  }
+#endif
+
 #if defined ENABLE_DEDUPE && !defined NO_HARDLINKS
   if (ISFLAG(flags, F_CONSIDERHARDLINKS) && ISFLAG(a_flags, FA_DEDUPEFILES))
     fprintf(stderr, "warning: option --dedupe overrides the behavior of --hardlinks\n");
@@ -602,16 +824,25 @@ skip_partialonly_noise:
       !!ISFLAG(a_flags, FA_HARDLINKFILES) +
       !!ISFLAG(a_flags, FA_MAKESYMLINKS) +
       !!ISFLAG(a_flags, FA_PRINTJSON) +
+      !!ISFLAG(a_flags, FA_PRINTNDJSON) +
       !!ISFLAG(a_flags, FA_PRINTUNIQUE) +
       !!ISFLAG(a_flags, FA_ERRORONDUPE) +
+      !!ISFLAG(a_flags, FA_PRINTSIMILAR) +
       !!ISFLAG(a_flags, FA_DEDUPEFILES);
 
   if (pm > 1) {
-      fprintf(stderr, "Only one of --summarize, --print-summarize, --delete, --link-hard,\n--link-soft, --json, --error-on-dupe, or --dedupe may be used\n");
+      fprintf(stderr, "Only one of --summarize, --print-summarize, --delete, --link-hard,\n--link-soft, --json, --ndjson, --error-on-dupe, --similar, or --dedupe may be used\n");
       exit(EXIT_FAILURE);
   }
   if (pm == 0) SETFLAG(a_flags, FA_PRINTMATCHES);
 
+#ifndef NO_STREAM
+  if (ISFLAG(flags, F_STREAM) && (a_flags & (FA_SUMMARIZEMATCHES | FA_PRINTUNIQUE | FA_PRINTJSON | FA_PRINTSIMILAR)) != 0) {
+    fprintf(stderr, "option --stream can't be used with --summarize, --print-unique, --json, or --similar\n");
+    exit(EXIT_FAILURE);
+  }
+#endif
+
 #ifndef ON_WINDOWS
   /* Catch SIGUSR1 and use it to enable -Z */
   signal(SIGUSR1, catch_sigusr1);
@@ -635,6 +866,7 @@ skip_partialonly_noise:
     jc_alarm_ring = 1;
   }
 
+  stats_start = stats_now();
   if (ISFLAG(flags, F_RECURSEAFTER)) {
     firstrecurse = nonoptafter("--recurse:", argc, oldargv, argv);
 
@@ -669,6 +901,8 @@ skip_partialonly_noise:
     }
   }
 
+  run_stats.phase_ns[PHASE_SCAN] = stats_now() - stats_start;
+
   /* Abort on CTRL-C (-Z doesn't matter yet) */
   if (unlikely(interrupt)) goto interrupt_exit;
 
@@ -692,6 +926,9 @@ skip_partialonly_noise:
   if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "\n");
   if (!files) goto skip_file_scan;
 
+#ifndef NO_STREAM
+  if (ISFLAG(flags, F_STREAM)) files = sort_files_by_size(files);
+#endif
   curfile = files;
   progress = 0;
 
@@ -702,15 +939,35 @@ skip_partialonly_noise:
     static file_t **match = NULL;
 
     if (unlikely(interrupt != 0)) {
-      if (!ISFLAG(flags, F_SOFTABORT)) exit(EXIT_FAILURE);
+      if (!ISFLAG(flags, F_SOFTABORT)) {
+#ifndef NO_HASHDB
+        /* Keep the hashes computed so far for the next run */
+        if (ISFLAG(flags, F_HASHDB)) checkpoint_hash_database(hashdb_name, 1);
+#endif
+        exit(EXIT_FAILURE);
+      }
       interrupt = 0;  /* reset interrupt for re-use */
       goto skip_file_scan;
     }
 
     LOUD(fprintf(stderr, "\nMAIN: current file: %s\n", curfile->d_name));
+    metrics_tick(PHASE_PARTIAL, curfile->d_name);
+
+#ifndef NO_STREAM
+    /* A new size means the previous size group is final */
+    if (ISFLAG(flags, F_STREAM)) {
+      if (stream_start != NULL && curfile->size != stream_start->size) {
+        stream_group(stream_start, stream_last, 0, argc, argv);
+        stream_start = NULL;
+      }
+      if (stream_start == NULL) stream_start = curfile;
+    }
+#endif /* NO_STREAM */
 
-    if (!checktree) registerfile(&checktree, NONE, curfile);
-    else match = checkmatch(checktree, curfile);
+    if (!checktree) {
+      registerfile(&checktree, NONE, curfile);
+      match = NULL;
+    } else match = checkmatch(checktree, curfile);
 
     /* Byte-for-byte check that a matched pair are actually matched */
     if (match != NULL) {
@@ -736,8 +993,20 @@ skip_partialonly_noise:
         goto skip_full_check;
       }
 
-      if (confirmmatch(curfile->d_name, (*match)->d_name, curfile->size) == 0) {
+      /* Pairs confirmed by an earlier run and unchanged since then can skip
+       * the byte-for-byte check without any loss of safety */
+      stats_start = stats_now();
+      if (
+#ifndef NO_HASHDB
+             (ISFLAG(flags, F_HASHDB) && hashdb_pair_confirmed(curfile, *match) == 1) ||
+#endif
+             confirmmatch(curfile->d_name, (*match)->d_name, curfile->size) == 0) {
+        run_stats.phase_ns[PHASE_CONFIRM] += stats_now() - stats_start;
         LOUD(fprintf(stderr, "MAIN: registering matched file pair\n"));
+#ifndef NO_HASHDB
+        /* registerpair() can change *match so this must be done first */
+        if (ISFLAG(flags, F_HASHDB)) hashdb_confirm_pair(curfile, *match);
+#endif
 #ifndef NO_MTIME
         registerpair(match, curfile, (ordertype == ORDER_TIME) ? sort_pairs_by_mtime : sort_pairs_by_filename);
 #else
@@ -745,12 +1014,15 @@ skip_partialonly_noise:
 #endif
         dupecount++;
       } else {
-	goto skip_full_check;
-        DBG(hash_fail++;)
+        run_stats.phase_ns[PHASE_CONFIRM] += stats_now() - stats_start;
+        hash_fail++;
       }
     }
 
 skip_full_check:
+#ifndef NO_STREAM
+    stream_last = curfile;
+#endif
     curfile = curfile->next;
 
     check_sigusr1();
@@ -758,45 +1030,46 @@ skip_full_check:
       jc_alarm_ring = 0;
       update_phase2_progress(NULL, -1);
     }
+#ifndef NO_HASHDB
+    if (ISFLAG(flags, F_HASHDB)) checkpoint_hash_database(hashdb_name, 0);
+#endif
+#ifndef NO_STREAM
+    if (ISFLAG(flags, F_STREAM) && ISFLAG(a_flags, FA_PRINTMATCHES)) tick_printmatches();
+#endif
+#ifndef NO_JSON
+    if (ISFLAG(a_flags, FA_PRINTNDJSON)) tick_ndjson();
+#endif
     progress++;
   }
 
-  if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "\r%60s\r", " ");
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) clear_progress();
 
 skip_file_scan:
   /* Stop catching CTRL+C and firing alarms */
   signal(SIGINT, SIG_DFL);
   if (!ISFLAG(flags, F_HIDEPROGRESS)) jc_stop_alarm();
 
-  if (files == NULL) {
-    printf("%s", s_no_dupes);
-    exit(exit_status);
-  }
-
-#ifndef NO_DELETE
-  if (ISFLAG(a_flags, FA_DELETEFILES)) {
-    if (ISFLAG(flags, F_NOPROMPT)) deletefiles(files, 0, 0);
-    else deletefiles(files, 1, stdin);
+#ifndef NO_STREAM
+  if (ISFLAG(flags, F_STREAM)) {
+    /* Finish the last group (or the partial group on a -Z abort) */
+    if (stream_start != NULL) stream_group(stream_start, stream_last, 1, argc, argv);
+    if (stream_sets == 0 && !ISFLAG(a_flags, FA_PRINTNDJSON)) printf("%s", s_no_dupes);
+    files = NULL;
+  } else
+#endif /* NO_STREAM */
+  {
+    /* An empty scan still needs the reports and hash database save below */
+    if (files == NULL) {
+      if (!ISFLAG(a_flags, FA_PRINTNDJSON)) printf("%s", s_no_dupes);
+    } else {
+      run_actions(files, argc, argv);
+      if (funnel_report != 0) funnel_add(files, NULL);
+    }
   }
-#endif /* NO_DELETE */
-#ifndef NO_SYMLINKS
-  if (ISFLAG(a_flags, FA_MAKESYMLINKS)) linkfiles(files, 0, 0);
-#endif /* NO_SYMLINKS */
-#ifndef NO_HARDLINKS
-  if (ISFLAG(a_flags, FA_HARDLINKFILES)) linkfiles(files, 1, 0);
-#endif /* NO_HARDLINKS */
-#ifdef ENABLE_DEDUPE
-  if (ISFLAG(a_flags, FA_DEDUPEFILES)) dedupefiles(files);
-#endif /* ENABLE_DEDUPE */
-  if (ISFLAG(a_flags, FA_PRINTMATCHES)) printmatches(files);
-  if (ISFLAG(a_flags, FA_PRINTUNIQUE)) printunique(files);
+  if (ISFLAG(a_flags, FA_PRINTMATCHES)) flush_printmatches();
 #ifndef NO_JSON
-  if (ISFLAG(a_flags, FA_PRINTJSON)) printjson(files, argc, argv);
-#endif /* NO_JSON */
-  if (ISFLAG(a_flags, FA_SUMMARIZEMATCHES)) {
-    if (ISFLAG(a_flags, FA_PRINTMATCHES)) printf("\n\n");
-    summarizematches(files);
-  }
+  if (ISFLAG(a_flags, FA_PRINTNDJSON)) finish_ndjson();
+#endif
 
 #ifndef NO_HASHDB
   if (ISFLAG(flags, F_HASHDB)) {
@@ -813,6 +1086,14 @@ skip_file_scan:
 skip_all_scan_code:
 #endif
 
+  metrics_finish();
+  if (stats_summary != 0) {
+    print_stats();
+    print_read_sizes();
+  }
+  if (funnel_report != 0) print_funnel();
+  if (stats_json_name != NULL && write_stats_json(stats_json_name) != 0) exit_status = EXIT_FAILURE;
+
 #ifdef DEBUG
   if (ISFLAG(flags, F_DEBUG)) {
     fprintf(stderr, "\n%d partial(%uKiB) (+%d small) -> %d full hash -> %d full (%d partial elim) (%d hash%u fail)\n",
@@ -23,6 +23,11 @@ extern "C" {
  #include <io.h>
 #endif /* Win32 */
 
+/* Metrics records are JSON and need Unix domain sockets */
+#if (defined NO_JSON || defined ON_WINDOWS) && !defined NO_METRICS
+ #define NO_METRICS 1
+#endif
+
 #include <limits.h>
 #include <stdint.h>
 #include <sys/types.h>
@@ -65,11 +70,11 @@ extern "C" {
  #endif
 #endif
 
-/* Debugging stats */
-#ifdef DEBUG
+/* Matching stats */
 extern unsigned int small_file, partial_hash, partial_elim;
 extern unsigned int full_hash, partial_to_full, hash_fail;
 extern uintmax_t comparisons;
+#ifdef DEBUG
  #ifdef ON_WINDOWS
   #ifndef NO_HARDLINKS
   extern unsigned int hll_exclude;
@@ -96,6 +101,11 @@ extern uintmax_t comparisons;
  #define auto_chunk_size CHUNK_SIZE
 #endif /* NO_CHUNKSIZE */
 
+/* Upper limit for -W/--workers */
+#ifndef MAX_WORKERS
+ #define MAX_WORKERS 256
+#endif
+
 /* Low memory option overrides */
 #ifdef LOW_MEMORY
  #ifndef NO_PERMS
@@ -149,6 +159,10 @@ extern uint64_t flags, a_flags, p_flags;
 #define F_NOCHANGECHECK		(1ULL << 17)
 #define F_NOTRAVCHECK		(1ULL << 18)
 #define F_SKIPHASH		(1ULL << 19)
+#define F_BLOCKHASH		(1ULL << 20)
+#define F_STREAM		(1ULL << 21)
+#define F_COLDCACHE		(1ULL << 22)
+#define F_AUTOREADSIZE		(1ULL << 23)
 #define F_BENCHMARKSTOP		(1ULL << 29)
 #define F_HASHDB		(1ULL << 30)
 
@@ -168,6 +182,9 @@ extern uint64_t flags, a_flags, p_flags;
 #define FA_PRINTNULL		(1U << 9)
 #define FA_PRINTJSON		(1U << 10)
 #define FA_ERRORONDUPE		(1U << 11)
+#define FA_DEDUPEBLOCKS		(1U << 12)
+#define FA_PRINTSIMILAR		(1U << 13)
+#define FA_PRINTNDJSON		(1U << 14)
 
 /* Per-file true/false flags */
 #define FF_VALID_STAT		(1U << 0)
@@ -191,6 +208,25 @@ typedef enum {
  #define PARTIAL_HASH_SIZE 4096
 #endif
 
+/* Block hash vectors (-b) cover the data after the partial hash in blocks
+ * of this size; smaller files use a single full hash as usual */
+#ifndef BLOCKHASH_SIZE
+ #define BLOCKHASH_SIZE 1048576
+#endif
+#ifndef BLOCKHASH_MIN_SIZE
+ #define BLOCKHASH_MIN_SIZE (BLOCKHASH_SIZE * 4)
+#endif
+#define BLOCKHASH_COUNT(a) ((uint32_t)(((a) - PARTIAL_HASH_SIZE + BLOCKHASH_SIZE - 1) / BLOCKHASH_SIZE))
+
+/* Per-block hashes for a large file; hash[] follows the struct in memory */
+typedef struct _blockhash {
+  uint64_t *hash;
+  uint32_t count;     /* number of blocks in the file */
+  uint32_t done;      /* number of blocks hashed so far */
+  uint64_t fullhash;  /* running full hash until all blocks are done */
+  void *state;        /* running xxHash state until all blocks are done */
+} blockhash_t;
+
 /* Per-file information */
 typedef struct _file {
   struct _file *duplicates;
@@ -198,10 +234,14 @@ typedef struct _file {
   char *d_name;
   uint64_t filehash_partial;
   uint64_t filehash;
+  blockhash_t *blockhash;
   jdupes_ino_t inode;
   off_t size;
 #ifndef NO_MTIME
   time_t mtime;
+  long mtime_nsec;
+  time_t ctime;  /* Change time is only used to validate cached hashes */
+  long ctime_nsec;
 #endif
   dev_t device;
   uint32_t flags;  /* Status flags */
@@ -241,6 +281,7 @@ extern char tempname[];
 extern const char *feature_flags[];
 extern const char *s_no_dupes;
 extern int exit_status;
+extern unsigned int worker_count;
 
 int file_has_changed(file_t * const restrict file);
 
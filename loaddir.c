@@ -19,6 +19,9 @@
 #endif
 #include "progress.h"
 #include "interrupt.h"
+#include "stats.h"
+#include "metrics.h"
+#include "probes.h"
 #ifndef NO_TRAVCHECK
  #include "travcheck.h"
 #endif
@@ -141,6 +144,7 @@ void loaddir(char * const restrict dir,
 
   item_progress++;
 
+  run_stats.opens[PHASE_SCAN]++;
   cd = jc_opendir(dir);
   if (unlikely(!cd)) goto error_cd;
   dirlen = strlen(dir);
@@ -152,11 +156,13 @@ void loaddir(char * const restrict dir,
     if (unlikely(interrupt != 0)) return;
     LOUD(fprintf(stderr, "loaddir: readdir: '%s'\n", dirinfo->d_name));
     if (unlikely(!jc_streq(dirinfo->d_name, ".") || !jc_streq(dirinfo->d_name, ".."))) continue;
+    PROBE2(dir_entry, dir, dirinfo->d_name);
     check_sigusr1();
     if (jc_alarm_ring != 0) {
       jc_alarm_ring = 0;
       update_phase1_progress("dirs");
     }
+    metrics_tick(PHASE_SCAN, dir);
 
     /* Assemble the file's full path name, optimized to avoid strcat() */
     dirpos = dirlen;
@@ -13,11 +13,15 @@
 #include "likely_unlikely.h"
 #include "checks.h"
 #include "filehash.h"
+#include "filestat.h"
 #ifndef NO_HASHDB
  #include "hashdb.h"
 #endif
 #include "interrupt.h"
 #include "match.h"
+#include "stats.h"
+#include "metrics.h"
+#include "probes.h"
 #include "progress.h"
 
 
@@ -94,7 +98,11 @@ void registerpair(file_t **matchlist, file_t *newmatch, int (*comparef)(file_t *
   }
 #endif
 
+  if (!ISFLAG((*matchlist)->flags, FF_HAS_DUPES)) run_stats.sets++;
   SETFLAG((*matchlist)->flags, FF_HAS_DUPES);
+  /* Mark set members here so --print-unique needs no extra pass */
+  SETFLAG((*matchlist)->flags, FF_NOT_UNIQUE);
+  SETFLAG(newmatch->flags, FF_NOT_UNIQUE);
   back = NULL;
   traverse = *matchlist;
 
@@ -166,6 +174,37 @@ void registerfile(filetree_t * restrict * const restrict nodeptr, const enum tre
 }
 
 
+/* Order two large files of the same size by their block hash vectors (-b)
+ * Each file is only read as far as the first block that differs; blocks
+ * are hashed in growing runs so that matching files don't reopen the file
+ * for every block. This is a consistent ordering for same-sized files, so
+ * it stands in for the full hash when placing files in the tree.
+ * Returns 0 with the comparison in *result, or -1 on a hashing failure */
+static int compare_blockhashes(file_t * const restrict file1, file_t * const restrict file2, int * const restrict result)
+{
+  uint32_t i, count;
+
+  if (unlikely(file1->size != file2->size)) {
+    fprintf(stderr, "\ninternal error: compare_blockhashes() called on files of different sizes, report this\n");
+    exit(EXIT_FAILURE);
+  }
+  count = BLOCKHASH_COUNT(file1->size);
+  for (i = 0; i < count; i++) {
+    if (file1->blockhash == NULL || file1->blockhash->done <= i)
+      if (get_blockhashes(file1, i * 2, hash_algo) != 0) return -1;
+    if (file2->blockhash == NULL || file2->blockhash->done <= i)
+      if (get_blockhashes(file2, i * 2, hash_algo) != 0) return -1;
+    *result = HASH_COMPARE(file1->blockhash->hash[i], file2->blockhash->hash[i]);
+    if (*result != 0) {
+      LOUD(fprintf(stderr, "compare_blockhashes: block %u of %u differs\n", i, count));
+      return 0;
+    }
+  }
+  *result = 0;
+  return 0;
+}
+
+
 /* Check two files for a match */
 file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict file)
 {
@@ -185,7 +224,7 @@ file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict file)
    * duplicates unless the user specifies otherwise. */
 
   /* Count the total number of comparisons requested */
-  DBG(comparisons++;)
+  comparisons++;
 
 /* If considering hard linked files as duplicates, they are
  * automatically duplicates without being read further since
@@ -241,7 +280,7 @@ file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict file)
     cmpresult = HASH_COMPARE(file->filehash_partial, tree->file->filehash_partial);
     LOUD(if (!cmpresult) fprintf(stderr, "checkmatch: partial hashes match\n"));
     LOUD(if (cmpresult) fprintf(stderr, "checkmatch: partial hashes do not match\n"));
-    DBG(partial_hash++;)
+    partial_hash++;
 
     /* Print partial hash matching pairs if requested */
     if (cmpresult == 0 && ISFLAG(p_flags, PF_PARTIAL))
@@ -257,7 +296,7 @@ file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict file)
 #ifndef NO_HASHDB
 	dirtyfile = 1;
 #endif
-        DBG(small_file++;)
+        small_file++;
       }
       if (!ISFLAG(tree->file->flags, FF_HASH_FULL)) {
         tree->file->filehash = tree->file->filehash_partial;
@@ -265,8 +304,29 @@ file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict file)
 #ifndef NO_HASHDB
 	dirtytree = 1;
 #endif
-        DBG(small_file++;)
+        small_file++;
       }
+    } else if (cmpresult == 0 && ISFLAG(flags, F_BLOCKHASH) && file->size >= BLOCKHASH_MIN_SIZE) {
+      /* Equal full hashes that are already known (e.g. from the hash database)
+       * show a match without reading, but the tree is ordered by block hashes
+       * so files whose full hashes differ still have to be placed by those */
+      if (!ISFLAG(file->flags, FF_HASH_FULL) || !ISFLAG(tree->file->flags, FF_HASH_FULL)
+          || HASH_COMPARE(file->filehash, tree->file->filehash) != 0) {
+#ifndef NO_HASHDB
+        const int bfile = (file->blockhash != NULL && file->blockhash->done == file->blockhash->count);
+        const int btree = (tree->file->blockhash != NULL && tree->file->blockhash->done == tree->file->blockhash->count);
+#endif
+
+        if (compare_blockhashes(file, tree->file, &cmpresult) != 0) return NULL;
+#ifndef NO_HASHDB
+        /* Completed vectors (and the full hashes that come with them) are saved */
+        if (!bfile && file->blockhash->done == file->blockhash->count) dirtyfile = 1;
+        if (!btree && tree->file->blockhash->done == tree->file->blockhash->count) dirtytree = 1;
+#endif
+      }
+      LOUD(if (!cmpresult) fprintf(stderr, "checkmatch: block hashes match\n"));
+      LOUD(if (cmpresult) fprintf(stderr, "checkmatch: block hashes do not match\n"));
+      full_hash++;
     } else if (cmpresult == 0) {
 //      if (ISFLAG(flags, F_SKIPHASH)) {
 //        LOUD(fprintf(stderr, "checkmatch: skipping full file hashes (F_SKIPMATCH)\n"));
@@ -298,10 +358,10 @@ file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict file)
         cmpresult = HASH_COMPARE(file->filehash, tree->file->filehash);
         LOUD(if (!cmpresult) fprintf(stderr, "checkmatch: full hashes match\n"));
         LOUD(if (cmpresult) fprintf(stderr, "checkmatch: full hashes do not match\n"));
-        DBG(full_hash++);
+        full_hash++;
 //      }
     } else {
-      DBG(partial_elim++);
+      partial_elim++;
     }
   }  /* if (cmpresult == 0) */
 
@@ -351,7 +411,7 @@ file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict file)
     }
   } else {
     /* All compares matched */
-    DBG(partial_to_full++;)
+    partial_to_full++;
     LOUD(fprintf(stderr, "checkmatch: files appear to match based on hashes\n"));
     if (ISFLAG(p_flags, PF_FULLHASH)) printf("Full hashes match:\n   %s\n   %s\n\n", file->d_name, tree->file->d_name);
     return &tree->file;
@@ -371,6 +431,7 @@ int confirmmatch(const char * const restrict file1, const char * const restrict
 
   if (unlikely(file1 == NULL || file2 == NULL)) jc_nullptr("confirmmatch()");
   LOUD(fprintf(stderr, "confirmmatch running\n"));
+  PROBE3(confirm_start, file1, file2, size);
 
   if (unlikely(c1 == NULL || c2 == NULL)) {
     c1 = (char *)malloc(auto_chunk_size);
@@ -378,6 +439,7 @@ int confirmmatch(const char * const restrict file1, const char * const restrict
   }
   if (unlikely(c1 == NULL || c2 == NULL)) jc_oom("confirmmatch() buffers");
 
+  run_stats.opens[PHASE_CONFIRM] += 2;
   fp1 = jc_fopen(file1, JC_FILE_MODE_RDONLY_SEQ);
   fp2 = jc_fopen(file2, JC_FILE_MODE_RDONLY_SEQ);
   if (fp1 == NULL) {
@@ -390,6 +452,10 @@ int confirmmatch(const char * const restrict file1, const char * const restrict
     LOUD(fprintf(stderr, "confirmmatch: warning: file open failed ('%s')\n", file2);)
     goto different;
   }
+  if (ISFLAG(flags, F_COLDCACHE)) {
+    drop_fd_cache(fileno(fp1));
+    drop_fd_cache(fileno(fp2));
+  }
 
   fseek(fp1, 0, SEEK_SET);
   fseek(fp2, 0, SEEK_SET);
@@ -407,9 +473,12 @@ int confirmmatch(const char * const restrict file1, const char * const restrict
     r2 = fread(c2, sizeof(char), auto_chunk_size, fp2);
 
     if (r1 != r2) goto different; /* file lengths are different */
+    STATS_READ(PHASE_CONFIRM, r1);
+    STATS_READ(PHASE_CONFIRM, r2);
     if (memcmp (c1, c2, r1)) goto different; /* file contents are different */
 
     bytes += (off_t)r1;
+    metrics_tick(PHASE_CONFIRM, file1);
     if (jc_alarm_ring != 0) {
       jc_alarm_ring = 0;
       update_phase2_progress("confirm", (int)((bytes * 100) / size));
@@ -425,5 +494,6 @@ different:
 finish_confirm:
 //  free(c1); free(c2);
   fclose(fp1); fclose(fp2);
+  PROBE4(confirm_done, file1, file2, bytes, retval);
   return retval;
 }
@@ -0,0 +1,215 @@
+/* jdupes live metrics stream (--metrics)
+ * One JSON record per line is written to a FIFO or a Unix domain socket at
+ * a set interval so other programs can follow a run without scraping the
+ * progress indicator
+ * This file is part of jdupes; see jdupes.c for license information */
+
+/* NO_METRICS may be implied by other options (see jdupes.h) */
+#include "jdupes.h"
+
+#ifndef NO_METRICS
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <libjodycode.h>
+#include "act_printjson.h"
+#include "metrics.h"
+
+#ifndef MSG_NOSIGNAL
+ #define MSG_NOSIGNAL 0
+#endif
+/* Records up to PIPE_BUF bytes are written to a FIFO atomically */
+#if defined PIPE_BUF && PIPE_BUF < 4096
+ #define METRICS_RECORD_MAX PIPE_BUF
+#else
+ #define METRICS_RECORD_MAX 4096
+#endif
+
+enum metrics_target { TARGET_FIFO, TARGET_STREAM, TARGET_DGRAM };
+
+int metrics_enabled = 0;
+
+static char metrics_path[PATHBUF_SIZE];
+static enum metrics_target metrics_target = TARGET_FIFO;
+static int metrics_fd = -1;
+static uint64_t metrics_interval = 1000000000;
+static uint64_t metrics_next = 0;
+static uintmax_t metrics_seq = 0, metrics_dropped = 0;
+
+
+/* (Re)connect to the reader. No reader yet is not an error; the next record
+ * just tries again */
+static void metrics_connect(void)
+{
+  struct sockaddr_un addr;
+
+  if (metrics_target == TARGET_FIFO) {
+    /* Fails with ENXIO until something opens the FIFO for reading */
+    metrics_fd = open(metrics_path, O_WRONLY | O_NONBLOCK);
+    return;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  /* metrics_open() made sure the path fits */
+  memcpy(addr.sun_path, metrics_path, strlen(metrics_path) + 1);
+  metrics_fd = socket(AF_UNIX, (metrics_target == TARGET_DGRAM) ? SOCK_DGRAM : SOCK_STREAM, 0);
+  if (metrics_fd < 0) return;
+  if (connect(metrics_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    const int err = errno;
+
+    close(metrics_fd);
+    metrics_fd = -1;
+    /* The listener might be a datagram socket */
+    if (err == EPROTOTYPE && metrics_target == TARGET_STREAM) {
+      metrics_target = TARGET_DGRAM;
+      metrics_connect();
+    }
+    return;
+  }
+  fcntl(metrics_fd, F_SETFL, fcntl(metrics_fd, F_GETFL) | O_NONBLOCK);
+  return;
+}
+
+
+/* Write one record without ever blocking the run; a record that doesn't
+ * fit in the pipe or socket buffer is dropped and counted */
+static void metrics_write(const char * const restrict buf, const size_t len)
+{
+  ssize_t written;
+
+  if (metrics_fd < 0) metrics_connect();
+  if (metrics_fd < 0) {
+    metrics_dropped++;
+    return;
+  }
+  if (metrics_target == TARGET_FIFO) written = write(metrics_fd, buf, len);
+  else written = send(metrics_fd, buf, len, MSG_NOSIGNAL);
+  if (written == (ssize_t)len) return;
+
+  metrics_dropped++;
+  if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+  /* The reader went away or a stream record was cut short; start over */
+  close(metrics_fd);
+  metrics_fd = -1;
+  return;
+}
+
+
+static void metrics_emit(const char * const restrict phase, const char * const restrict name, const uint64_t now)
+{
+  char buf[METRICS_RECORD_MAX];
+  const uint64_t ms = (now - run_stats.start_ns) / 1000000;
+  uintmax_t bytes = 0;
+  int len;
+
+  for (int i = 0; i < PHASE_COUNT; i++) bytes += run_stats.bytes[i];
+
+  len = snprintf(buf, sizeof(buf), "{\"seq\":%" PRIuMAX ",\"pid\":%ld,\"seconds\":%" PRIu64 ".%03u,\"phase\":\"%s\","
+      "\"filesScanned\":%" PRIuMAX ",\"filesChecked\":%" PRIuMAX ",\"bytesRead\":%" PRIuMAX ",\"bytesHashed\":%" PRIuMAX ","
+      "\"pairsMatched\":%" PRIuMAX ",\"setsFound\":%" PRIuMAX ",\"dropped\":%" PRIuMAX ",\"file\":",
+      metrics_seq++, (long)getpid(), ms / 1000, (unsigned int)(ms % 1000), phase,
+      filecount, progress, bytes, run_stats.bytes[PHASE_PARTIAL] + run_stats.bytes[PHASE_FULL],
+      dupecount, run_stats.sets, metrics_dropped);
+  if (len < 0 || (size_t)len > sizeof(buf) - 32) return;
+  if (name == NULL) {
+    memcpy(buf + len, "null", 4);
+    len += 4;
+  } else {
+    /* Long names are cut short so the record stays atomic */
+    buf[len++] = '"';
+    len = (int)(json_escape(name, buf + len, sizeof(buf) - (size_t)len - 24) - buf);
+    buf[len++] = '"';
+  }
+  buf[len++] = '}';
+  buf[len++] = '\n';
+  metrics_write(buf, (size_t)len);
+  return;
+}
+
+
+/* Parse PATH[:SECS] for --metrics and connect if a reader is waiting
+ * Returns 0 on success or -1 on failure */
+int metrics_open(const char * const restrict arg)
+{
+  const char *colon = strrchr(arg, ':');
+  struct sockaddr_un addr;
+  struct stat st;
+  size_t len = strlen(arg);
+
+  /* A trailing ":number" is the interval; other colons belong to the path */
+  if (colon != NULL && colon[1] != '\0' && strspn(colon + 1, "0123456789.") == strlen(colon + 1)) {
+    const double secs = strtod(colon + 1, NULL);
+
+    if (secs < 0.1) goto error_interval;
+    metrics_interval = (uint64_t)(secs * 1000000000.0);
+    len = (size_t)(colon - arg);
+  }
+  if (len == 0 || len >= sizeof(metrics_path)) goto error_path;
+  memcpy(metrics_path, arg, len);
+  metrics_path[len] = '\0';
+
+  if (stat(metrics_path, &st) != 0) goto error_stat;
+  if (S_ISFIFO(st.st_mode)) {
+    metrics_target = TARGET_FIFO;
+    /* A reader closing the FIFO must not kill the run */
+    signal(SIGPIPE, SIG_IGN);
+  } else if (S_ISSOCK(st.st_mode)) {
+    if (len >= sizeof(addr.sun_path)) goto error_path;
+    metrics_target = TARGET_STREAM;
+  } else goto error_type;
+
+  metrics_enabled = 1;
+  metrics_connect();
+  return 0;
+
+error_interval:
+  fprintf(stderr, "error: --metrics interval must be at least 0.1 seconds\n");
+  return -1;
+error_path:
+  fprintf(stderr, "error: --metrics: bad or too long path '%s'\n", arg);
+  return -1;
+error_stat:
+  fprintf(stderr, "error: --metrics: can't use '%s': %s\n", metrics_path, strerror(errno));
+  return -1;
+error_type:
+  fprintf(stderr, "error: --metrics: '%s' is not a FIFO or Unix domain socket\n", metrics_path);
+  return -1;
+}
+
+
+/* Write a record if the interval has passed */
+void metrics_record(const enum stats_phase phase, const char * const restrict name)
+{
+  const uint64_t now = stats_now();
+
+  if (now < metrics_next) return;
+  metrics_next = now + metrics_interval;
+  metrics_emit(stats_phase_names[phase], name, now);
+  return;
+}
+
+
+/* Final record so readers can tell a finished run from a stalled one */
+void metrics_finish(void)
+{
+  if (metrics_enabled == 0) return;
+  metrics_emit("done", NULL, stats_now());
+  if (metrics_fd >= 0) close(metrics_fd);
+  metrics_fd = -1;
+  metrics_enabled = 0;
+  return;
+}
+
+#endif /* NO_METRICS */
@@ -0,0 +1,32 @@
+/* jdupes live metrics stream (--metrics)
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef JDUPES_METRICS_H
+#define JDUPES_METRICS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "stats.h"
+
+#ifndef NO_METRICS
+extern int metrics_enabled;
+
+int metrics_open(const char * const restrict arg);
+void metrics_record(const enum stats_phase phase, const char * const restrict name);
+void metrics_finish(void);
+
+/* Called often from the scan, hash and compare loops; a record is only
+ * written when the configured interval has passed */
+ #define metrics_tick(phase, name) do { if (metrics_enabled != 0) metrics_record(phase, name); } while (0)
+#else
+ #define metrics_tick(phase, name)
+ #define metrics_finish()
+#endif /* NO_METRICS */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_METRICS_H */
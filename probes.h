@@ -0,0 +1,42 @@
+/* jdupes static tracepoints (USDT)
+ * Build with 'make USDT=1' to place probes for bpftrace, perf, SystemTap and
+ * other tools that read <sys/sdt.h> notes. Each probe site is a single nop
+ * until a tracer attaches to it. Without USDT the probes compile to nothing
+ * but their arguments are still type checked.
+ *
+ * Provider "jdupes"; probe names and arguments:
+ *   dir_entry     (dir, name)
+ *   stat_start    (path)
+ *   stat_done     (path, result)         0 = ok, -1 = stat() failed
+ *   hash_start    (path, offset, length)
+ *   hash_done     (path, bytes, result)  0 = ok, -1 = failed
+ *   blocks_start  (path, offset, length)
+ *   blocks_done   (path, offset, result) offset where reading stopped
+ *   confirm_start (path1, path2, size)
+ *   confirm_done  (path1, path2, bytes, result) 0 = same, 1 = different
+ *   delete_start  (path)
+ *   delete_done   (path, result)         0 = ok, 1 = changed, 2 = failed
+ *   link_start    (src, dest, type)      0 = symlink, 1 = hard, 2 = clone
+ *   link_done     (src, dest, result)    0 = ok, -1 = failed
+ *   dedupe_start  (src_fd, offset, length, dest_count)
+ *   dedupe_done   (src_fd, offset, length, result) 0 = ok, -errno = failed
+ *
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef JDUPES_PROBES_H
+#define JDUPES_PROBES_H
+
+#ifdef USE_USDT
+ #include <sys/sdt.h>
+ #define PROBE1(name, a)          DTRACE_PROBE1(jdupes, name, a)
+ #define PROBE2(name, a, b)       DTRACE_PROBE2(jdupes, name, a, b)
+ #define PROBE3(name, a, b, c)    DTRACE_PROBE3(jdupes, name, a, b, c)
+ #define PROBE4(name, a, b, c, d) DTRACE_PROBE4(jdupes, name, a, b, c, d)
+#else
+ #define PROBE1(name, a)          do { if (0) { (void)(a); } } while (0)
+ #define PROBE2(name, a, b)       do { if (0) { (void)(a); (void)(b); } } while (0)
+ #define PROBE3(name, a, b, c)    do { if (0) { (void)(a); (void)(b); (void)(c); } } while (0)
+ #define PROBE4(name, a, b, c, d) do { if (0) { (void)(a); (void)(b); (void)(c); (void)(d); } } while (0)
+#endif /* USE_USDT */
+
+#endif /* JDUPES_PROBES_H */
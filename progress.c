@@ -5,12 +5,24 @@
 #include <inttypes.h>
 #include "jdupes.h"
 #include "likely_unlikely.h"
+#include "stats.h"
+#include "progress.h"
+
+/* Widest progress line written so far, so that clear_progress() can erase it */
+static int progress_width = 0;
+
+
+static void note_progress_width(const int width)
+{
+  if (width > progress_width) progress_width = width;
+  return;
+}
 
 
 void update_phase1_progress(const char * const restrict type)
 {
-  fprintf(stderr, "\rScanning: %" PRIuMAX " files, %" PRIuMAX " %s (in %u specified)",
-          progress, item_progress, type, user_item_count);
+  note_progress_width(fprintf(stderr, "\rScanning: %" PRIuMAX " files, %" PRIuMAX " %s (in %u specified)",
+          progress, item_progress, type, user_item_count));
 //  fflush(stderr);
 }
 
@@ -18,16 +30,48 @@ void update_phase1_progress(const char * const restrict type)
 void update_phase2_progress(const char * const restrict msg, const int file_percent)
 {
   static int did_fpct = 0;
+  static uint64_t last_ns = 0;
+  static uintmax_t last_bytes = 0, last_progress = 0, byte_rate = 0, file_rate = 0;
+  const uint64_t now = stats_now();
+  const uintmax_t bytes = run_stats.bytes[PHASE_PARTIAL] + run_stats.bytes[PHASE_FULL] + run_stats.bytes[PHASE_CONFIRM];
+  int width;
+
+  /* Throughput since the previous sample; samples closer than half a
+   * second apart are skipped so the numbers don't jump around */
+  if (last_ns == 0 || now - last_ns >= 500000000) {
+    const uint64_t ms = (now - last_ns) / 1000000;
 
-  fprintf(stderr, "\rProgress [%" PRIuMAX "/%" PRIuMAX ", %" PRIuMAX " pairs matched] %" PRIuMAX "%%",
-    progress, filecount, dupecount, (progress * 100) / filecount);
+    if (last_ns != 0 && ms > 0) {
+      byte_rate = ((bytes - last_bytes) * 1000) / ms;
+      file_rate = ((progress - last_progress) * 1000) / ms;
+    }
+    last_ns = now;
+    last_bytes = bytes;
+    last_progress = progress;
+  }
+
+  width = fprintf(stderr, "\rProgress [%" PRIuMAX "/%" PRIuMAX ", %" PRIuMAX " pairs matched] %" PRIuMAX "%%, %" PRIuMAX ".%" PRIuMAX " MB/s, %" PRIuMAX " files/s  ",
+    progress, filecount, dupecount, (progress * 100) / filecount,
+    byte_rate / 1000000, (byte_rate / 100000) % 10, file_rate);
   if (file_percent > -1 && msg != NULL) {
-    fprintf(stderr, "  (%s: %d%%)         ", msg, file_percent);
+    width += fprintf(stderr, "(%s: %d%%)         ", msg, file_percent);
     did_fpct = 1;
   } else if (did_fpct != 0) {
-    fprintf(stderr, "                     ");
+    width += fprintf(stderr, "                     ");
     did_fpct = 0;
   }
+  note_progress_width(width);
 //  fflush(stderr);
   return;
 }
+
+
+/* Erase the progress line, however wide it got */
+void clear_progress(void)
+{
+  if (progress_width == 0) return;
+  /* The leading '\r' was counted as part of the width */
+  fprintf(stderr, "\r%*s\r", progress_width - 1, "");
+  progress_width = 0;
+  return;
+}
@@ -10,6 +10,7 @@ extern "C" {
 
 void update_phase1_progress(const char * const restrict type);
 void update_phase2_progress(const char * const restrict msg, const int file_percent);
+void clear_progress(void);
 
 #ifdef __cplusplus
 }
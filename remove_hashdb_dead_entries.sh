@@ -1,13 +1,18 @@
 #!/bin/bash
 
+# NOTE: "hashdb_util <database> clean" does this much faster; this script
+# is only kept for systems where hashdb_util cannot be built. Block hash
+# vectors stored by -b/--block-hashes are dropped by this script.
+
 [[ -z "$1" || ! -e "$1" ]] && echo "Specify a hash database to clean" >&2 && exit 1
 
 HASHDB="$1"
 TEMPDB="_jdupes_hashdb_clean.tmp"
 ERR=0; CNT=0
-LINELEN=87
+LINELEN=87; SORTKEY=7
 
 [ "$HASHDB" = "." ] && HASHDB="jdupes_hashdb.txt"
+grep -q -m 1 '^jdupes hashdb:3,' "$HASHDB" && LINELEN=139 && SORTKEY=11
 
 clean_exit () {
 	echo "Terminated, cleaning up." >&2
@@ -17,8 +22,8 @@ clean_exit () {
 
 trap clean_exit INT TERM HUP ABRT QUIT
 
-if ! grep -q -m 1 '^jdupes hashdb:2,' "$HASHDB"
-	then echo "Must be a version 2 database, exiting" >&2
+if ! grep -q -m 1 '^jdupes hashdb:[23],' "$HASHDB"
+	then echo "Must be a version 2 or 3 database, exiting" >&2
 	exit 1
 fi
 
@@ -38,7 +43,7 @@ while read LINE
 	echo "$LINE" >> "$TEMPDB" || ERR=1
 	CNT=$((CNT + 1))
 	echo -n "Processed $CNT/$SRCLINES lines ($((CNT * 100 / SRCLINES))%)"$'\r'
-done < <(grep -v '^jdupes hashdb:' "$HASHDB" | sort -k7 -t,)
+done < <(grep -v '^jdupes hashdb:\|^+' "$HASHDB" | sort -k$SORTKEY -t,)
 
 if [ $ERR -eq 1 ]
 	then echo "Error writing out lines, not overwriting hash database" >&2
@@ -59,3 +59,40 @@ int sort_pairs_by_filename(file_t *f1, file_t *f2)
   return strcmp(f1->d_name, f2->d_name) > 0 ? sort_direction : -sort_direction;
 #endif /* NO_NUMSORT */
 }
+
+
+/* Stable merge sort of the file list by size, smallest first */
+file_t *sort_files_by_size(file_t *list)
+{
+  file_t *left, *right, *slow, *fast, *tail;
+  file_t head;
+
+  if (list == NULL || list->next == NULL) return list;
+
+  /* Split the list in half */
+  slow = list;
+  fast = list->next;
+  while (fast != NULL && fast->next != NULL) {
+    slow = slow->next;
+    fast = fast->next->next;
+  }
+  right = slow->next;
+  slow->next = NULL;
+  left = sort_files_by_size(list);
+  right = sort_files_by_size(right);
+
+  /* Merge, taking from the left on ties to keep the scan order */
+  tail = &head;
+  while (left != NULL && right != NULL) {
+    if (right->size < left->size) {
+      tail->next = right;
+      right = right->next;
+    } else {
+      tail->next = left;
+      left = left->next;
+    }
+    tail = tail->next;
+  }
+  tail->next = (left != NULL) ? left : right;
+  return head.next;
+}
@@ -0,0 +1,154 @@
+/* jdupes run statistics
+ * Counters are cheap enough to always collect; --stats-json writes them out
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#ifdef ON_WINDOWS
+ #define WIN32_LEAN_AND_MEAN
+ #include <windows.h>
+#else
+ #include <time.h>
+ #include <sys/resource.h>
+#endif
+
+#include <libjodycode.h>
+#include "jdupes.h"
+#include "version.h"
+#include "stats.h"
+
+struct run_stats run_stats;
+
+const char *stats_phase_names[PHASE_COUNT] = {
+  "scan", "partialHash", "fullHash", "confirm", "action"
+};
+
+static const char *phase_labels[PHASE_COUNT] = {
+  "scan", "partial hash", "full hash", "confirm", "action"
+};
+
+
+/* Monotonic time in nanoseconds */
+uint64_t stats_now(void)
+{
+#ifdef ON_WINDOWS
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+
+  if (freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (uint64_t)((now.QuadPart / freq.QuadPart) * 1000000000
+      + ((now.QuadPart % freq.QuadPart) * 1000000000) / freq.QuadPart);
+#else
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) return 0;
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+
+/* Bytes or items per second, rounded down */
+static uintmax_t per_second(const uintmax_t count, const uint64_t ns)
+{
+  if (ns == 0) return 0;
+  return (uintmax_t)(((long double)count * 1000000000) / ns);
+}
+
+
+/* Print a per-phase breakdown to stderr (--stats) */
+void print_stats(void)
+{
+  const uint64_t total = stats_now() - run_stats.start_ns;
+  int i;
+
+  fprintf(stderr, "\nRun statistics:\n");
+  fprintf(stderr, "  %-13s%4" PRIu64 ".%03" PRIu64 " s, %" PRIuMAX " files, %" PRIuMAX " dirs, %" PRIuMAX " stat calls, %" PRIuMAX " files/s\n",
+      "scan:", run_stats.phase_ns[PHASE_SCAN] / 1000000000, (run_stats.phase_ns[PHASE_SCAN] % 1000000000) / 1000000,
+      filecount, run_stats.opens[PHASE_SCAN], run_stats.stat_calls,
+      per_second(filecount, run_stats.phase_ns[PHASE_SCAN]));
+  for (i = PHASE_PARTIAL; i <= PHASE_CONFIRM; i++) {
+    const uint64_t ns = run_stats.phase_ns[i];
+
+    fprintf(stderr, "  %s:%*s%4" PRIu64 ".%03" PRIu64 " s, %" PRIuMAX " KiB in %" PRIuMAX " reads, %" PRIuMAX " opens, %" PRIuMAX " MB/s\n",
+        phase_labels[i], (int)(12 - strlen(phase_labels[i])), "", ns / 1000000000, (ns % 1000000000) / 1000000,
+        run_stats.bytes[i] >> 10, run_stats.reads[i], run_stats.opens[i],
+        per_second(run_stats.bytes[i], ns) / 1000000);
+  }
+  fprintf(stderr, "  %-13s%4" PRIu64 ".%03" PRIu64 " s\n", "action:",
+      run_stats.phase_ns[PHASE_ACTION] / 1000000000, (run_stats.phase_ns[PHASE_ACTION] % 1000000000) / 1000000);
+  fprintf(stderr, "  %-13s%4" PRIu64 ".%03" PRIu64 " s\n", "total:", total / 1000000000, (total % 1000000000) / 1000000);
+  return;
+}
+
+
+static void print_seconds(FILE *fp, const uint64_t ns)
+{
+  fprintf(fp, "%" PRIu64 ".%06" PRIu64, ns / 1000000000, (ns % 1000000000) / 1000);
+  return;
+}
+
+
+/* Write the run statistics as a JSON document (--stats-json)
+ * Returns 0 on success or -1 on failure */
+int write_stats_json(const char * const restrict name)
+{
+  FILE *fp;
+  int i;
+
+  fp = fopen(name, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "error: can't write statistics to %s: %s\n", name, strerror(errno));
+    return -1;
+  }
+
+  fprintf(fp, "{\n  \"jdupesVersion\": \"%s\",\n", VER);
+  fprintf(fp, "  \"files\": {\n");
+  fprintf(fp, "    \"scanned\": %" PRIuMAX ",\n", filecount);
+  fprintf(fp, "    \"statCalls\": %" PRIuMAX ",\n", run_stats.stat_calls);
+  fprintf(fp, "    \"duplicates\": %" PRIuMAX "\n  },\n", dupecount);
+
+  fprintf(fp, "  \"matching\": {\n");
+  fprintf(fp, "    \"comparisons\": %" PRIuMAX ",\n", comparisons);
+  fprintf(fp, "    \"partialHashCompares\": %u,\n", partial_hash);
+  fprintf(fp, "    \"partialEliminated\": %u,\n", partial_elim);
+  fprintf(fp, "    \"smallFiles\": %u,\n", small_file);
+  fprintf(fp, "    \"fullHashCompares\": %u,\n", full_hash);
+  fprintf(fp, "    \"hashMatches\": %u,\n", partial_to_full);
+  fprintf(fp, "    \"confirmFailed\": %u\n  },\n", hash_fail);
+
+  fprintf(fp, "  \"phases\": {\n");
+  for (i = 0; i < PHASE_COUNT; i++) {
+    fprintf(fp, "    \"%s\": { \"seconds\": ", stats_phase_names[i]);
+    print_seconds(fp, run_stats.phase_ns[i]);
+    fprintf(fp, ", \"bytesRead\": %" PRIuMAX ", \"reads\": %" PRIuMAX ", \"opens\": %" PRIuMAX " }%s\n",
+        run_stats.bytes[i], run_stats.reads[i], run_stats.opens[i], (i < PHASE_COUNT - 1) ? "," : "");
+  }
+  fprintf(fp, "  },\n");
+#ifndef ON_WINDOWS
+  {
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+#ifdef __APPLE__
+      ru.ru_maxrss /= 1024;  /* macOS reports bytes */
+#endif
+      fprintf(fp, "  \"maxRssKiB\": %ld,\n", (long)ru.ru_maxrss);
+      fprintf(fp, "  \"cpuSeconds\": { \"user\": %ld.%06ld, \"system\": %ld.%06ld },\n",
+          (long)ru.ru_utime.tv_sec, (long)ru.ru_utime.tv_usec, (long)ru.ru_stime.tv_sec, (long)ru.ru_stime.tv_usec);
+    }
+  }
+#endif
+  fprintf(fp, "  \"seconds\": ");
+  print_seconds(fp, stats_now() - run_stats.start_ns);
+  fprintf(fp, "\n}\n");
+
+  if (fclose(fp) != 0) {
+    fprintf(stderr, "error: can't write statistics to %s: %s\n", name, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
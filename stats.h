@@ -0,0 +1,47 @@
+/* jdupes run statistics
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef JDUPES_STATS_H
+#define JDUPES_STATS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* Phases that are timed and counted separately */
+enum stats_phase {
+  PHASE_SCAN = 0,  /* Directory traversal (loaddir) */
+  PHASE_PARTIAL,   /* Partial hashing */
+  PHASE_FULL,      /* Full and block hashing */
+  PHASE_CONFIRM,   /* Byte-for-byte confirmation */
+  PHASE_ACTION,
+  PHASE_COUNT
+};
+
+struct run_stats {
+  uintmax_t stat_calls;
+  uintmax_t opens[PHASE_COUNT];  /* Files or directories opened */
+  uintmax_t reads[PHASE_COUNT];  /* Read calls */
+  uintmax_t bytes[PHASE_COUNT];  /* Bytes read */
+  uint64_t phase_ns[PHASE_COUNT];
+  uint64_t start_ns;
+  uintmax_t sets;  /* Duplicate sets found so far */
+};
+
+extern struct run_stats run_stats;
+extern const char *stats_phase_names[PHASE_COUNT];
+
+/* Count one read of 'len' bytes */
+#define STATS_READ(phase, len) do { run_stats.reads[phase]++; run_stats.bytes[phase] += (uintmax_t)(len); } while (0)
+
+uint64_t stats_now(void);
+void print_stats(void);
+int write_stats_json(const char * const restrict name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_STATS_H */